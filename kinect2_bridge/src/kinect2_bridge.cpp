@@ -23,7 +23,9 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
+#include <functional>
 #include <sys/stat.h>
 
 #include <opencv2/opencv.hpp>
@@ -63,11 +65,17 @@ private:
   cv::Mat map1Color, map2Color, map1Ir, map2Ir, map1LowRes, map2LowRes;
 
   std::vector<std::thread> threads;
-  std::mutex lockIrDepth, lockColor, lockColorFrame;
+  // Workers wait for a stream that is due for its next frame and not received by another worker
+  std::mutex lockDispatch;
+  std::condition_variable dispatchChanged;
+  bool nextColor, nextIrDepth, receivingColor, receivingIrDepth;
+
+  std::mutex lockColorFrame;
   std::mutex lockSync, lockPub, lockTime, lockStatus;
   std::mutex lockRegLowRes, lockRegHighRes;
 
-  bool publishTF;
+  // Registration methods that can be called from several threads at once do not need the locks above
+  bool publishTF, regProfiling, regConcurrent;
   std::thread tfPublisher, mainThread;
 
   libfreenect2::Freenect2 freenect2;
@@ -82,11 +90,17 @@ private:
   ros::NodeHandle nh, priv_nh;
 
   DepthRegistration *depthRegLowRes, *depthRegHighRes;
+  // Threads shared by both CPU registrations, OpenMP is used if not set
+  std::shared_ptr<RegistrationScheduler> regScheduler;
+  // Threads the independent color branches run on, the registration threads if set, otherwise a small pool of its own
+  std::shared_ptr<RegistrationScheduler> colorScheduler;
+  // Images of the high res registration into both cameras, one set per worker. They are published before the worker takes
+  // the next frame, so their buffers are registered into again.
+  std::vector<std::vector<cv::Mat> > registeredDepth;
 
   size_t frameColor, frameIrDepth, pubFrameColor, pubFrameIrDepth;
   ros::Time lastColor, lastDepth;
 
-  bool nextColor, nextIrDepth;
   double deltaT, depthShift, elapsedTimeColor, elapsedTimeIrDepth;
   bool running, deviceActive, clientConnected;
 
@@ -131,7 +145,7 @@ public:
   Kinect2Bridge(const ros::NodeHandle &nh = ros::NodeHandle(), const ros::NodeHandle &priv_nh = ros::NodeHandle("~"))
     : sizeColor(1920, 1080), sizeIr(512, 424), sizeLowRes(sizeColor.width / 2, sizeColor.height / 2), colorFrame(1920, 1080, 4), nh(nh), priv_nh(priv_nh),
       frameColor(0), frameIrDepth(0), pubFrameColor(0), pubFrameIrDepth(0), lastColor(0, 0), lastDepth(0, 0), nextColor(false),
-      nextIrDepth(false), depthShift(0), running(false), deviceActive(false), clientConnected(false)
+      nextIrDepth(false), receivingColor(false), receivingIrDepth(false), depthShift(0), running(false), deviceActive(false), clientConnected(false)
   {
     color = cv::Mat::zeros(sizeColor, CV_8UC3);
     ir = cv::Mat::zeros(sizeIr, CV_32F);
@@ -206,8 +220,8 @@ private:
   {
     double fps_limit, maxDepth, minDepth;
     bool use_png, bilateral_filter, edge_aware_filter;
-    int32_t jpeg_quality, png_level, queueSize, reg_dev, depth_dev, worker_threads;
-    std::string depth_method, reg_method, calib_path, sensor, base_name;
+    int32_t jpeg_quality, png_level, queueSize, reg_dev, reg_threshold, reg_threads, depth_dev, worker_threads;
+    std::string depth_method, reg_method, reg_cores, calib_path, sensor, base_name;
 
     std::string depthDefault = "cpu";
     std::string regDefault = "default";
@@ -233,6 +247,10 @@ private:
     priv_nh.param("depth_device", depth_dev, -1);
     priv_nh.param("reg_method", reg_method, regDefault);
     priv_nh.param("reg_devive", reg_dev, -1);
+    priv_nh.param("reg_profiling", regProfiling, false);
+    priv_nh.param("reg_threshold", reg_threshold, 0);
+    priv_nh.param("reg_threads", reg_threads, 0);
+    priv_nh.param("reg_cores", reg_cores, std::string(""));
     priv_nh.param("max_depth", maxDepth, 12.0);
     priv_nh.param("min_depth", minDepth, 0.1);
     priv_nh.param("queue_size", queueSize, 2);
@@ -244,6 +262,7 @@ private:
 
     worker_threads = std::max(1, worker_threads);
     threads.resize(worker_threads);
+    registeredDepth.resize(worker_threads);
 
     std::cout << "parameter:" << std::endl
               << "        base_name: " << base_name << std::endl
@@ -257,6 +276,10 @@ private:
               << "     depth_device: " << depth_dev << std::endl
               << "       reg_method: " << reg_method << std::endl
               << "       reg_devive: " << reg_dev << std::endl
+              << "    reg_profiling: " << (regProfiling ? "true" : "false") << std::endl
+              << "    reg_threshold: " << reg_threshold << std::endl
+              << "      reg_threads: " << reg_threads << std::endl
+              << "        reg_cores: " << reg_cores << std::endl
               << "        max_depth: " << maxDepth << std::endl
               << "        min_depth: " << minDepth << std::endl
               << "       queue_size: " << queueSize << std::endl
@@ -287,7 +310,9 @@ private:
 
     initCalibration(calib_path, sensor);
 
-    if(!initRegistration(reg_method, reg_dev, maxDepth))
+    initScheduler(reg_threads, reg_cores);
+
+    if(!initRegistration(reg_method, reg_dev, reg_threshold, maxDepth))
     {
       device->close();
       delete listenerIrDepth;
@@ -301,9 +326,36 @@ private:
     return true;
   }
 
-  bool initRegistration(const std::string &method, const int32_t device, const double maxDepth)
+  void initScheduler(const int32_t threads, const std::string &cores)
+  {
+    std::vector<int> coreList;
+    std::istringstream iss(cores);
+    std::string core;
+    while(std::getline(iss, core, ','))
+    {
+      if(!core.empty())
+      {
+        coreList.push_back(atoi(core.c_str()));
+      }
+    }
+
+    // Same priority as the worker threads, so that registration does not take the cores from the rest of the system
+    if(threads > 0)
+    {
+      regScheduler.reset(new RegistrationThreadPool(threads, coreList, 19));
+      colorScheduler = regScheduler;
+      return;
+    }
+
+    // At most four color branches, one of them runs on the calling worker. The pool is shared by all workers, so it adds a
+    // fixed number of threads instead of a team per worker.
+    colorScheduler.reset(new RegistrationThreadPool(3, coreList, 19));
+  }
+
+  bool initRegistration(const std::string &method, const int32_t device, const int32_t threshold, const double maxDepth)
   {
     DepthRegistration::Method reg;
+    regConcurrent = false;
 
     if(method == "default")
     {
@@ -316,6 +368,33 @@ private:
 #else
       std::cerr << "CPU registration is not available!" << std::endl;
       return false;
+#endif
+    }
+    else if(method == "cpu_fused")
+    {
+#ifdef DEPTH_REG_CPU
+      reg = DepthRegistration::CPU_FUSED;
+#else
+      std::cerr << "CPU registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "cpu_sparse")
+    {
+#ifdef DEPTH_REG_CPU
+      reg = DepthRegistration::CPU_SPARSE;
+#else
+      std::cerr << "CPU registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "cpu_incremental")
+    {
+#ifdef DEPTH_REG_CPU
+      reg = DepthRegistration::CPU_INCREMENTAL;
+#else
+      std::cerr << "CPU registration is not available!" << std::endl;
+      return false;
 #endif
     }
     else if(method == "opencl")
@@ -325,6 +404,62 @@ private:
 #else
       std::cerr << "OpenCL registration is not available!" << std::endl;
       return false;
+#endif
+    }
+    else if(method == "opencl_atomic")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_ATOMIC;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "opencl_runtime")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_RUNTIME;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "opencl_atomic_runtime")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_ATOMIC_RUNTIME;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "opencl_image")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_IMAGE;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "opencl_multi")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_MULTI;
+      regConcurrent = true;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
+#endif
+    }
+    else if(method == "opencl_multi_atomic")
+    {
+#ifdef DEPTH_REG_OPENCL
+      reg = DepthRegistration::OPENCL_MULTI_ATOMIC;
+      regConcurrent = true;
+#else
+      std::cerr << "OpenCL registration is not available!" << std::endl;
+      return false;
 #endif
     }
     else
@@ -335,9 +470,16 @@ private:
 
     depthRegLowRes = DepthRegistration::New(reg);
     depthRegHighRes = DepthRegistration::New(reg);
+    depthRegLowRes->setProfiling(regProfiling);
+    depthRegHighRes->setProfiling(regProfiling);
+    depthRegLowRes->setIncrementalThreshold(threshold);
+    depthRegHighRes->setIncrementalThreshold(threshold);
+    depthRegLowRes->setScheduler(regScheduler);
+    depthRegHighRes->setScheduler(regScheduler);
 
     if(!depthRegLowRes->init(cameraMatrixLowRes, sizeLowRes, cameraMatrixDepth, sizeIr, distortionDepth, rotation, translation, 0.5f, maxDepth, device) ||
-       !depthRegHighRes->init(cameraMatrixColor, sizeColor, cameraMatrixDepth, sizeIr, distortionDepth, rotation, translation, 0.5f, maxDepth, device))
+       !depthRegHighRes->init(cameraMatrixColor, sizeColor, cameraMatrixDepth, sizeIr, distortionDepth, rotation, translation, 0.5f, maxDepth, device) ||
+       !depthRegHighRes->addTarget(cameraMatrixLowRes, sizeLowRes))
     {
       delete depthRegLowRes;
       delete depthRegHighRes;
@@ -742,14 +884,33 @@ private:
     return any || infoHDPub.getNumSubscribers() > 0 || infoQHDPub.getNumSubscribers() > 0 || infoIRPub.getNumSubscribers() > 0;
   }
 
+  void printProfile(const std::string &name, DepthRegistration *reg)
+  {
+    std::vector<DepthRegistration::ProfileStage> stages;
+    reg->getProfile(stages);
+    if(stages.empty())
+    {
+      return;
+    }
+
+    std::ostringstream oss;
+    oss.precision(3);
+    oss << "[kinect2_bridge] " << name << " registration (median/p90/max ms):";
+    for(size_t i = 0; i < stages.size(); ++i)
+    {
+      const DepthRegistration::ProfileStage &stage = stages[i];
+      oss << ' ' << stage.name << ' ' << stage.median << '/' << stage.p90 << '/' << stage.max;
+    }
+    std::cout << oss.str() << std::endl;
+  }
+
   void main()
   {
     std::cout << "[kinect2_bridge] waiting for clients to connect" << std::endl << std::endl;
     double nextFrame = ros::Time::now().toSec() + deltaT;
     double fpsTime = ros::Time::now().toSec();
     size_t oldFrameIrDepth = 0, oldFrameColor = 0;
-    nextColor = true;
-    nextIrDepth = true;
+    requestFrames();
 
     for(; running && ros::ok();)
     {
@@ -780,13 +941,17 @@ private:
 
         std::cout << "[kinect2_bridge] depth processing: ~" << framesIrDepth / tDepth << "Hz (" << (tDepth / framesIrDepth) * 1000 << "ms) publishing rate: ~" << framesIrDepth / fpsTime << "Hz" << std::endl
                   << "[kinect2_bridge] color processing: ~" << framesColor / tColor << "Hz (" << (tColor / framesColor) * 1000 << "ms) publishing rate: ~" << framesColor / fpsTime << "Hz" << std::endl << std::flush;
+        if(regProfiling)
+        {
+          printProfile("qhd", depthRegLowRes);
+          printProfile("hd", depthRegHighRes);
+        }
         fpsTime = now;
       }
 
       if(now >= nextFrame)
       {
-        nextColor = true;
-        nextIrDepth = true;
+        requestFrames();
         nextFrame += deltaT;
       }
 
@@ -803,49 +968,106 @@ private:
         continue;
       }
     }
+
+    // Workers check running while holding the dispatch lock, taking it makes sure none of them misses the wakeup
+    lockDispatch.lock();
+    lockDispatch.unlock();
+    dispatchChanged.notify_all();
   }
 
   void threadDispatcher(const size_t id)
   {
     const size_t checkFirst = id % 2;
-    bool processedFrame = false;
     int oldNice = nice(0);
     oldNice = nice(19 - oldNice);
 
-    for(; running && ros::ok();)
+    for(;;)
     {
-      processedFrame = false;
-
-      for(size_t i = 0; i < 2; ++i)
+      bool irDepth;
       {
-        if(i == checkFirst)
+        std::unique_lock<std::mutex> guard(lockDispatch);
+        for(;;)
         {
-          if(nextIrDepth && lockIrDepth.try_lock())
+          if(!running || !ros::ok())
+          {
+            return;
+          }
+
+          const bool readyIrDepth = nextIrDepth && !receivingIrDepth;
+          const bool readyColor = nextColor && !receivingColor;
+          if(readyIrDepth || readyColor)
           {
-            nextIrDepth = false;
-            receiveIrDepth();
-            processedFrame = true;
+            irDepth = readyIrDepth && (checkFirst == 0 || !readyColor);
+            break;
           }
+          dispatchChanged.wait(guard);
+        }
+
+        if(irDepth)
+        {
+          nextIrDepth = false;
+          receivingIrDepth = true;
         }
         else
         {
-          if(nextColor && lockColor.try_lock())
-          {
-            nextColor = false;
-            receiveColor();
-            processedFrame = true;
-          }
+          nextColor = false;
+          receivingColor = true;
         }
       }
 
-      if(!processedFrame)
+      if(irDepth)
       {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        receiveIrDepth(id);
       }
+      else
+      {
+        receiveColor();
+      }
+    }
+  }
+
+  // Marks both streams as due for their next frame and wakes one worker for each stream that nobody is waiting for yet
+  void requestFrames()
+  {
+    bool wakeIrDepth, wakeColor;
+    lockDispatch.lock();
+    wakeIrDepth = !nextIrDepth && !receivingIrDepth;
+    wakeColor = !nextColor && !receivingColor;
+    nextIrDepth = true;
+    nextColor = true;
+    lockDispatch.unlock();
+
+    if(wakeIrDepth)
+    {
+      dispatchChanged.notify_one();
+    }
+    if(wakeColor)
+    {
+      dispatchChanged.notify_one();
+    }
+  }
+
+  // Called once a frame is taken from the listener, so another worker can wait for the next one while this one processes it.
+  // Without fps limit the stream is due again right away, otherwise main() requests the next frame.
+  void releaseStream(bool &next, bool &receiving)
+  {
+    bool wake;
+    lockDispatch.lock();
+    receiving = false;
+    if(deltaT <= 0.0)
+    {
+      next = true;
+    }
+    wake = next;
+    lockDispatch.unlock();
+
+    if(wake)
+    {
+      dispatchChanged.notify_one();
     }
   }
 
-  void receiveIrDepth()
+  void receiveIrDepth(const size_t id)
   {
     libfreenect2::FrameMap frames;
     cv::Mat depth, ir;
@@ -856,7 +1078,7 @@ private:
 
     if(!receiveFrames(listenerIrDepth, frames))
     {
-      lockIrDepth.unlock();
+      releaseStream(nextIrDepth, receivingIrDepth);
       return;
     }
     double now = ros::Time::now().toSec();
@@ -870,9 +1092,9 @@ private:
     depth = cv::Mat(depthFrame->height, depthFrame->width, CV_32FC1, depthFrame->data);
 
     frame = frameIrDepth++;
-    lockIrDepth.unlock();
+    releaseStream(nextIrDepth, receivingIrDepth);
 
-    processIrDepth(ir, depth, images, status, depthFrame);
+    processIrDepth(ir, depth, images, status, depthFrame, registeredDepth[id]);
 
     publishImages(images, header, status, frame, pubFrameIrDepth, IR_SD, COLOR_HD);
 
@@ -895,7 +1117,7 @@ private:
 
     if(!receiveFrames(listenerColor, frames))
     {
-      lockColor.unlock();
+      releaseStream(nextColor, receivingColor);
       return;
     }
     double now = ros::Time::now().toSec();
@@ -907,7 +1129,7 @@ private:
     color = cv::Mat(colorFrame->height, colorFrame->width, CV_8UC4, colorFrame->data);
 
     frame = frameColor++;
-    lockColor.unlock();
+    releaseStream(nextColor, receivingColor);
 
     processColor(color, images, status, colorFrame);
 
@@ -965,7 +1187,8 @@ private:
     return header;
   }
 
-  void processIrDepth(const cv::Mat &ir, const cv::Mat &depth, std::vector<cv::Mat> &images, const std::vector<Status> &status, libfreenect2::Frame *depthFrame)
+  void processIrDepth(const cv::Mat &ir, const cv::Mat &depth, std::vector<cv::Mat> &images, const std::vector<Status> &status, libfreenect2::Frame *depthFrame,
+                      std::vector<cv::Mat> &registeredTargets)
   {
     // COLOR registered to depth
     if(status[COLOR_SD_RECT])
@@ -1006,17 +1229,39 @@ private:
     {
       cv::remap(depthShifted, images[DEPTH_SD_RECT], map1Ir, map2Ir, cv::INTER_NEAREST);
     }
-    if(status[DEPTH_QHD])
+    if(status[DEPTH_QHD] && status[DEPTH_HD])
     {
-      lockRegLowRes.lock();
+      // High res registration also registers into the low res camera, sharing most of the work
+      std::unique_lock<std::mutex> lock(lockRegHighRes, std::defer_lock);
+      if(!regConcurrent)
+      {
+        lock.lock();
+      }
+      depthRegHighRes->registerDepth(depthShifted, registeredTargets);
+      if(lock.owns_lock())
+      {
+        lock.unlock();
+      }
+      images[DEPTH_HD] = registeredTargets[0];
+      images[DEPTH_QHD] = registeredTargets[1];
+    }
+    else if(status[DEPTH_QHD])
+    {
+      std::unique_lock<std::mutex> lock(lockRegLowRes, std::defer_lock);
+      if(!regConcurrent)
+      {
+        lock.lock();
+      }
       depthRegLowRes->registerDepth(depthShifted, images[DEPTH_QHD]);
-      lockRegLowRes.unlock();
     }
-    if(status[DEPTH_HD])
+    else if(status[DEPTH_HD])
     {
-      lockRegHighRes.lock();
+      std::unique_lock<std::mutex> lock(lockRegHighRes, std::defer_lock);
+      if(!regConcurrent)
+      {
+        lock.lock();
+      }
       depthRegHighRes->registerDepth(depthShifted, images[DEPTH_HD]);
-      lockRegHighRes.unlock();
     }
   }
 
@@ -1040,35 +1285,73 @@ private:
       cv::flip(color, tmp, 1);
       cv::cvtColor(tmp, images[COLOR_HD], CV_BGRA2BGR);
     }
+    // The other images only depend on COLOR_HD, so their branches are processed concurrently
+    std::vector<std::function<void()>> branches;
     if(status[COLOR_HD_RECT] || status[MONO_HD_RECT])
     {
-      cv::remap(images[COLOR_HD], images[COLOR_HD_RECT], map1Color, map2Color, cv::INTER_AREA);
+      branches.push_back([&]()
+      {
+        cv::remap(images[COLOR_HD], images[COLOR_HD_RECT], map1Color, map2Color, cv::INTER_AREA);
+        if(status[MONO_HD_RECT])
+        {
+          cv::cvtColor(images[COLOR_HD_RECT], images[MONO_HD_RECT], CV_BGR2GRAY);
+        }
+      });
     }
     if(status[COLOR_QHD] || status[MONO_QHD])
     {
-      cv::resize(images[COLOR_HD], images[COLOR_QHD], sizeLowRes, 0, 0, cv::INTER_AREA);
+      branches.push_back([&]()
+      {
+        cv::resize(images[COLOR_HD], images[COLOR_QHD], sizeLowRes, 0, 0, cv::INTER_AREA);
+        if(status[MONO_QHD])
+        {
+          cv::cvtColor(images[COLOR_QHD], images[MONO_QHD], CV_BGR2GRAY);
+        }
+      });
     }
     if(status[COLOR_QHD_RECT] || status[MONO_QHD_RECT])
     {
-      cv::remap(images[COLOR_HD], images[COLOR_QHD_RECT], map1LowRes, map2LowRes, cv::INTER_AREA);
+      branches.push_back([&]()
+      {
+        cv::remap(images[COLOR_HD], images[COLOR_QHD_RECT], map1LowRes, map2LowRes, cv::INTER_AREA);
+        if(status[MONO_QHD_RECT])
+        {
+          cv::cvtColor(images[COLOR_QHD_RECT], images[MONO_QHD_RECT], CV_BGR2GRAY);
+        }
+      });
     }
 
     // MONO
     if(status[MONO_HD])
     {
-      cv::cvtColor(images[COLOR_HD], images[MONO_HD], CV_BGR2GRAY);
-    }
-    if(status[MONO_HD_RECT])
-    {
-      cv::cvtColor(images[COLOR_HD_RECT], images[MONO_HD_RECT], CV_BGR2GRAY);
+      branches.push_back([&]()
+      {
+        cv::cvtColor(images[COLOR_HD], images[MONO_HD], CV_BGR2GRAY);
+      });
     }
-    if(status[MONO_QHD])
+
+    runConcurrently(branches);
+  }
+
+  // The calling worker runs one of the tasks itself and the threads of the color scheduler take the others
+  void runConcurrently(const std::vector<std::function<void()>> &tasks)
+  {
+    const int count = (int)tasks.size();
+    if(colorScheduler && count > 1)
     {
-      cv::cvtColor(images[COLOR_QHD], images[MONO_QHD], CV_BGR2GRAY);
+      colorScheduler->parallelFor(count, [&](const int begin, const int end, const int)
+      {
+        for(int i = begin; i < end; ++i)
+        {
+          tasks[i]();
+        }
+      });
+      return;
     }
-    if(status[MONO_QHD_RECT])
+
+    for(int i = 0; i < count; ++i)
     {
-      cv::cvtColor(images[COLOR_QHD_RECT], images[MONO_QHD_RECT], CV_BGR2GRAY);
+      tasks[i]();
     }
   }
 
@@ -1362,6 +1645,10 @@ void help(const std::string &path)
   helpOption("depth_device",      "int",    "-1",           "openCL device to use for depth processing");
   helpOption("reg_method",        "string", regDefault,     "Use specific depth registration: " + regMethods);
   helpOption("reg_devive",        "int",    "-1",           "openCL device to use for depth registration");
+  helpOption("reg_profiling",     "bool",   "false",        "print the durations of the registration stages on the device");
+  helpOption("reg_threshold",     "int",    "0",            "depth changes in mm ignored by the incremental registration");
+  helpOption("reg_threads",       "int",    "0",            "threads shared by the CPU registrations and the color images, 0 uses OpenMP for the registrations and 3 threads for the color images");
+  helpOption("reg_cores",         "string", "",             "comma separated cores the registration and color threads are bound to");
   helpOption("max_depth",         "double", "12.0",         "max depth value");
   helpOption("min_depth",         "double", "0.1",          "min depth value");
   helpOption("queue_size",        "int",    "2",            "queue size of publisher");
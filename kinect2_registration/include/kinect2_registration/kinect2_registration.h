@@ -19,10 +19,15 @@
 #ifndef __KINECT2_REGISTRATION_H__
 #define __KINECT2_REGISTRATION_H__
 
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include <opencv2/opencv.hpp>
 
+#include <kinect2_registration/registration_scheduler.h>
+
 class DepthRegistration
 {
 public:
@@ -30,17 +35,112 @@ public:
   {
     DEFAULT = 0,
     CPU,
-    OPENCL
+    OPENCL,
+    CPU_FUSED,
+    CPU_SPARSE,
+    OPENCL_ATOMIC,
+    OPENCL_RUNTIME,
+    OPENCL_ATOMIC_RUNTIME,
+    OPENCL_IMAGE,
+    OPENCL_MULTI,
+    // CPU registration in double precision, slow but useful as a reference for the other methods
+    CPU_DOUBLE,
+    // CPU registration that only updates the parts of the registered image affected by changes of the depth image
+    CPU_INCREMENTAL,
+    // Registration on all OpenCL devices with the atomic kernels of OPENCL_ATOMIC
+    OPENCL_MULTI_ATOMIC
+  };
+
+  // Durations of one stage of the registration over the last frames in milliseconds
+  struct ProfileStage
+  {
+    std::string name;
+    size_t count;
+    double mean, min, median, p90, p99, max;
   };
 
 protected:
-  cv::Mat cameraMatrixRegistered, cameraMatrixDepth, rotation, translation, mapX, mapY;
+  cv::Mat cameraMatrixRegistered, cameraMatrixDepth, distortionDepth, rotation, translation, mapX, mapY;
   cv::Size sizeRegistered, sizeDepth;
+  std::vector<cv::Mat> cameraMatrixTargets;
+  std::vector<cv::Size> sizeTargets;
   float zNear, zFar;
 
+  // Joint bilateral hole filling, disabled if the radius is 0
+  int fillRadius;
+  float fillSigmaColor;
+  // Spatial weights of the (2 * radius + 1)^2 window and color weights indexed by the summed absolute BGR difference
+  std::vector<float> fillSpatial, fillRange;
+  cv::Mat bufferFill, bufferCount;
+
+  // Depth changes up to this value in millimeters are ignored by the incremental registration
+  int incrementalThreshold;
+
+  // Images returned by getHostBuffers for backends without special host memory
+  cv::Mat hostDepth, hostRegistered;
+
+  // Result of the last registerDepthAsync call for backends without asynchronous support, copied out by finishDepthAsync and
+  // reused for the next frame
+  cv::Mat bufferAsync;
+  bool asyncPending;
+
+  // Rays of the registered camera model, used to create point clouds from the registered depth
+  std::vector<float> cloudLookupX, cloudLookupY;
+
+  // Ring buffers with the last durations of each profiled stage, in the order the stages were first recorded
+  struct ProfileWindow
+  {
+    std::string name;
+    std::vector<double> samples;
+    size_t next;
+  };
+
+  bool profiling;
+  std::vector<ProfileWindow> profileWindows;
+  std::mutex profileLock;
+
+  // Runs the parallel loops on the CPU, OpenMP is used if none is set
+  std::shared_ptr<RegistrationScheduler> scheduler;
+
   DepthRegistration();
 
   virtual bool init(const int deviceId) = 0;
+  virtual bool initTarget(const size_t index) = 0;
+  // Called by updateCalibration after the maps and lookups have been updated
+  virtual bool calibrationChanged() = 0;
+
+  void initMaps();
+  void addProfileSample(const std::string &stage, const double duration);
+
+  // Loop body passed by parallelFor, body points to the callable of the caller
+  typedef void (*LoopFunc)(const void *body, const int index, const int thread);
+
+  // Calls func(index, thread) for every index in [0, count) on the scheduler or with OpenMP. The thread index is below
+  // threadCount() and unique among the calls running at the same time. Balance distributes the indices dynamically, for loops
+  // with uneven work per index. The callable is only referenced, so that running a loop does not allocate memory.
+  template<typename Func>
+  void parallelFor(const int count, const Func &func, const bool balance = false) const
+  {
+    parallelFor(count, &callLoop<Func>, &func, balance);
+  }
+  void parallelFor(const int count, const LoopFunc loop, const void *body, const bool balance) const;
+  int threadCount() const;
+
+  template<typename Func>
+  static void callLoop(const void *body, const int index, const int thread)
+  {
+    (*static_cast<const Func *>(body))(index, thread);
+  }
+
+  void fillHoles(const cv::Mat &color, cv::Mat &registered);
+  void createCloud(const cv::Mat &registered, const cv::Mat *color, cv::Mat &cloud) const;
+
+  bool checkROI(const cv::Rect &roi) const;
+  // Region of the undistorted depth image that can project into the region of interest. Backends that also write a point to
+  // pixels next to the one it is projected to pass how many pixels they reach.
+  cv::Rect sourceRegion(const cv::Rect &roi, const double reach = 0) const;
+  // Region of the depth image the bilinear remapping of the given region of the undistorted image reads from
+  cv::Rect remapRegion(const cv::Rect &region) const;
 
 public:
   virtual ~DepthRegistration();
@@ -49,8 +149,70 @@ public:
             const cv::Mat &distortionDepth, const cv::Mat &rotation, const cv::Mat &translation,
             const float zNear = 0.5f, const float zFar = 12.0f, const int deviceId = -1);
 
+  // Adds another camera model the depth image is registered into. Has to be called after init, which removes all added targets.
+  bool addTarget(const cv::Mat &cameraMatrix, const cv::Size &size);
+
   virtual void registerDepth(const cv::Mat &depth, cv::Mat &registered) = 0;
 
+  // Replaces the calibration given to init, the image sizes and the added targets stay the same. Backends with the camera model
+  // compiled into their kernels are reinitialized, which also releases the host buffers, others just update it.
+  bool updateCalibration(const cv::Mat &cameraMatrixRegistered, const cv::Mat &cameraMatrixDepth, const cv::Mat &distortionDepth,
+                         const cv::Mat &rotation, const cv::Mat &translation);
+
+  // Registers the depth image into the camera model given to init and all added targets, in that order.
+  virtual void registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered) = 0;
+
+  // Registers only the given region of the registered image. The result has the size of the region and its top left pixel
+  // corresponds to the top left corner of the region. Depth pixels outside of the region that project into it are taken into
+  // account, as long as their depth is between zNear and zFar.
+  virtual void registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered) = 0;
+
+  // Returns a depth and a registered image that registerDepth can use without additional copies. Backends that transfer the
+  // images to a device allocate them in host memory shared with it. Write the depth image into the returned one and pass both to
+  // registerDepth. The content of the registered image is valid until the next call to registerDepth, init releases them.
+  virtual void getHostBuffers(cv::Mat &depth, cv::Mat &registered);
+
+  // Pipelined registration: starts registering the depth image and returns the registered image of the previous call. Returns
+  // false if there is no previous frame. The depth image is copied and can be reused right away. Backends without asynchronous
+  // support register the frame immediately and return it on the next call.
+  virtual bool registerDepthAsync(const cv::Mat &depth, cv::Mat &registered);
+
+  // Waits for the frame started by the last call to registerDepthAsync. Returns false if there is none.
+  virtual bool finishDepthAsync(cv::Mat &registered);
+
+  // Enables measuring the durations of the uploads, kernels and downloads on the device. Has to be called before init. Backends
+  // that do not run on a device do not record anything.
+  void setProfiling(const bool enable);
+
+  // Returns statistics of the durations of each stage over the last frames. Reset clears the recorded durations.
+  virtual void getProfile(std::vector<ProfileStage> &stages, const bool reset = false);
+
+  // Runs the CPU parts of the registration on the given scheduler instead of OpenMP, so that several registrations and the
+  // rest of an application can share the same threads. Has to be called before init. Backends running on a device only use it
+  // for the hole filling and the point clouds.
+  void setScheduler(const std::shared_ptr<RegistrationScheduler> &scheduler);
+
+  // Enables filling of holes in the registered depth image guided by the color image. A radius of 0 disables it.
+  void setHoleFilling(const int radius, const float sigmaColor = 10.0f);
+
+  // Sets the largest change of a depth pixel in millimeters that the incremental registration treats as noise. Parts of the
+  // depth image with smaller changes keep their previous result. 0 registers every change, other methods ignore it.
+  void setIncrementalThreshold(const int threshold);
+
+  // Registers the depth image and fills holes using the color image of the registered camera model, if enabled.
+  virtual void registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered);
+
+  // Registers the depth image and creates an organized point cloud in the registered camera frame. The cloud is a CV_32FC3 image
+  // with the x, y, z coordinates in meters, invalid points are NaN. The points are back-projected from the registered depth
+  // through the pixel centers, the same as consumers of the registered image would do, not taken from the projected points.
+  // It is a convenience and is not faster than back-projecting the registered image elsewhere.
+  virtual void registerDepth(const cv::Mat &depth, cv::Mat &registered, cv::Mat &cloud);
+
+  // Same as above, but fills holes if enabled and creates a CV_32FC4 cloud. The fourth channel contains the color as packed BGRA
+  // bytes. The points are packed with 16 bytes each, so the data can be published as a PointCloud2 with fields x, y, z, rgb at
+  // offsets 0, 4, 8, 12 and a point_step of 16. It does not match the 32 byte memory layout of pcl::PointXYZRGB.
+  virtual void registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered, cv::Mat &cloud);
+
   static DepthRegistration *New(Method method = DEFAULT);
 };
 
@@ -0,0 +1,77 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#ifndef __REGISTRATION_SCHEDULER_H__
+#define __REGISTRATION_SCHEDULER_H__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the parallel loops of the CPU registration. Implement it to run them on the threads of an application instead of OpenMP.
+class RegistrationScheduler
+{
+public:
+  virtual ~RegistrationScheduler();
+
+  // Number of different thread indices passed to the loop functions
+  virtual int threadCount() const = 0;
+
+  // Calls func(begin, end, thread) for disjoint ranges covering [0, count) and returns after all of them finished. Ranges of
+  // one call with the same thread index must not run at the same time. Has to support concurrent calls from several threads.
+  virtual void parallelFor(const int count, const std::function<void(const int, const int, const int)> &func) = 0;
+};
+
+// Fixed number of threads that split each loop into chunks. The calling thread works on the chunks of its own loop as well, so
+// concurrent calls from several threads share the pool without waiting for each other to finish.
+class RegistrationThreadPool : public RegistrationScheduler
+{
+private:
+  struct Job
+  {
+    const std::function<void(const int, const int, const int)> *func;
+    int count, chunkSize, chunks, next, done;
+  };
+
+  std::vector<std::thread> threads;
+  // Jobs with chunks left, in the order they were added. The capacity is kept, so that adding a job does not allocate memory.
+  std::vector<Job *> jobs;
+  std::mutex lock;
+  std::condition_variable jobAdded, jobDone;
+  bool running;
+
+public:
+  // Cores lists the CPUs the threads are bound to, assigned round robin, an empty list does not bind them. The threads run
+  // with the given nice value, which only lowers their priority if not running as root.
+  RegistrationThreadPool(const int threadCount, const std::vector<int> &cores = std::vector<int>(), const int niceness = 0);
+
+  ~RegistrationThreadPool();
+
+  int threadCount() const;
+
+  void parallelFor(const int count, const std::function<void(const int, const int, const int)> &func);
+
+private:
+  void threadWorker(const int id, const int core, const int niceness);
+  bool takeChunk(Job *job, int &chunk);
+  void runChunk(Job *job, const int chunk, const int thread);
+};
+
+#endif //__REGISTRATION_SCHEDULER_H__
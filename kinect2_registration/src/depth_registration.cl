@@ -15,19 +15,44 @@
  * limitations under the License.
  */
 
+// With PARAM_BUFFER the camera model is read from a constant buffer instead of being compiled in, so that the calibration can be
+// updated without rebuilding the program. The layout matches DepthRegistrationOpenCL::uploadParams.
+#ifdef PARAM_BUFFER
+#define CAMERA_PARAMS , constant float *params
+#define r00 params[0]
+#define r01 params[1]
+#define r02 params[2]
+#define r10 params[3]
+#define r11 params[4]
+#define r12 params[5]
+#define r20 params[6]
+#define r21 params[7]
+#define r22 params[8]
+#define tx params[9]
+#define ty params[10]
+#define tz params[11]
+#define fxR params[12]
+#define fyR params[13]
+#define cxR params[14]
+#define cyR params[15]
+#define fxRInv params[16]
+#define fyRInv params[17]
+#else
+#define CAMERA_PARAMS
+#endif
+
 // Set render buffer to zero
 void kernel setZero(global ushort* rendered, global float *selDist){
-  const uint i = get_global_id(0);
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
   rendered[i] = 0;
   selDist[i] = 10;
 }
 
 // Calculate 3d point, project them to color camera coordinate system and create rendered depth image
-void kernel project(global const ushort *depth, global int4 *idx, global ushort *zImg, global float4 *dists, global float *selDist, global ushort *rendered){
-  const uint i = get_global_id(0);
-
-  const int xR = i % widthR;
-  const int yR = i / widthR;
+void kernel project(global const ushort *depth, global int4 *idx, global ushort *zImg, global float4 *dists, global float *selDist, global ushort *rendered CAMERA_PARAMS){
+  const int xR = get_global_id(0);
+  const int yR = get_global_id(1);
+  const uint i = yR * widthR + xR;
 
   const ushort d = depth[i];
 
@@ -79,6 +104,10 @@ void kernel project(global const ushort *depth, global int4 *idx, global ushort
   {
     indices.s2 = indices.s3 = -1;
   }
+  if(d < zNear || d > zFar || projected.z <= 0)
+  {
+    indices = (int4)(-1);
+  }
   if(indices.s0 >= 0)
   {
     selDist[indices.s0] = dist2.s0;
@@ -107,7 +136,7 @@ void kernel project(global const ushort *depth, global int4 *idx, global ushort
 
 // checks and updates registered depth image to make sure nearest depth values are used
 void kernel checkDepth(global const int4 *idx, global const ushort *zImg, global const float4 *dists, global float *selDist, global ushort *rendered){
-  const uint i = get_global_id(0);
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
 
   const int4 index = idx[i];
   const ushort zI = zImg[i];
@@ -142,19 +171,133 @@ void kernel checkDepth(global const int4 *idx, global const ushort *zImg, global
   }
 }
 
+// Set packed z-buffer to the largest value
+void kernel setZeroAtomic(global uint *zBuffer){
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
+  zBuffer[i] = 0xFFFFFFFF;
+}
+
+// Same projection as project, but conflicts are resolved with an atomic min on the depth in the upper and the squared distance
+// to the pixel in the lower 16 bit. Replaces project and both checkDepth passes.
+void kernel projectAtomic(global const ushort *depth, volatile global uint *zBuffer CAMERA_PARAMS){
+  const int xR = get_global_id(0);
+  const int yR = get_global_id(1);
+  const uint i = yR * widthR + xR;
+
+  const ushort d = depth[i];
+  if(d < zNear || d > zFar)
+  {
+    return;
+  }
+
+  // Projection matrix coloumns
+  const float4 projX = (float4)(r00, r01, r02, tx);
+  const float4 projY = (float4)(r10, r11, r12, ty);
+  const float4 projZ = (float4)(r20, r21, r22, tz);
+
+  // Compute 3D point
+  const float z = d / 1000.0f;
+  const float4 point = (float4)((xR - cxR) * fxRInv * z, (yR - cyR) * fyRInv * z, z, 1.0f);
+
+  // Rotate and translate
+  const float3 projected = (float3)(dot(point, projX), dot(point, projY), dot(point, projZ));
+  if(projected.z <= 0)
+  {
+    return;
+  }
+
+  const float invZ = 1.0f / projected.z;
+
+  // Compute projected image coordinates
+  const float x = (fxR * projected.x) * invZ + cxR;
+  const float y = (fyR * projected.y) * invZ + cyR;
+  const int xL = (int)floor(x);
+  const int yL = (int)floor(y);
+  const int xH = xL + 1;
+  const int yH = yL + 1;
+
+  const float4 distXY = (float4)((x - xL) * (x - xL), (xH - x) * (xH - x), (y - yL) * (y - yL), (yH - y) * (yH - y));
+  const float4 dist2 = (float4)(distXY.s0 + distXY.s2, distXY.s1 + distXY.s2, distXY.s0 + distXY.s3, distXY.s1 + distXY.s3);
+
+  // The squared distances are at most 2, so they fit into 16 bit with this scale
+  const uint zI = ((uint)(projected.z * 1000.0f)) << 16;
+  const uint4 packed = (uint4)(zI) | convert_uint4(dist2 * 32767.0f);
+
+  if(yL >= 0 && yL < heightR)
+  {
+    if(xL >= 0 && xL < widthR)
+    {
+      atomic_min(&zBuffer[yL * widthR + xL], packed.s0);
+    }
+    if(xH >= 0 && xH < widthR)
+    {
+      atomic_min(&zBuffer[yL * widthR + xH], packed.s1);
+    }
+  }
+  if(yH >= 0 && yH < heightR)
+  {
+    if(xL >= 0 && xL < widthR)
+    {
+      atomic_min(&zBuffer[yH * widthR + xL], packed.s2);
+    }
+    if(xH >= 0 && xH < widthR)
+    {
+      atomic_min(&zBuffer[yH * widthR + xH], packed.s3);
+    }
+  }
+}
+
+// Extract the depth from the packed z-buffer, empty pixels become 0
+void kernel resolveDepth(global const uint *zBuffer, global ushort *rendered){
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
+  const uint packed = zBuffer[i];
+  rendered[i] = packed == 0xFFFFFFFF ? 0 : packed >> 16;
+}
+
+// interpolate the depth from the four neighbors, if at least three of them are valid and similar
+ushort interpolateDepth(const float4 p, const float x, const float y, const int xL, const int yL)
+{
+  const int xH = xL + 1;
+  const int yH = yL + 1;
+
+  int4 valid = isgreaterequal(p, (float4)(1));
+  int count = abs(valid.s0 + valid.s1 + valid.s2 + valid.s3);
+
+  if(count < 3)
+  {
+    return 0;
+  }
+
+  const float avg = (p.s0 + p.s1 + p.s2 + p.s3) / count;
+  const float thres = 0.01 * avg;
+  valid = isless(fabs(p - avg), (float4)(thres));
+  count = abs(valid.s0 + valid.s1 + valid.s2 + valid.s3);
+
+  if(count < 3)
+  {
+    return 0;
+  }
+
+  const float4 distXY = (float4)((x - xL) * (x - xL), (xH - x) * (xH - x), (y - yL) * (y - yL), (yH - y) * (yH - y));
+  const float4 tmp = (float4)(sqrt(2.0));
+  const float4 dist2 = (float4)(distXY.s0 + distXY.s2, distXY.s1 + distXY.s2, distXY.s0 + distXY.s3, distXY.s1 + distXY.s3);
+  const float4 dist = select((float4)(0), tmp - sqrt(dist2), valid);
+  const float sum = dist.s0 + dist.s1 + dist.s2 + dist.s3;
+
+  return (dot(p, dist) / sum) + 0.5;
+}
+
 // remap depth image
 void kernel remapDepth(global const ushort *in, global ushort *out, global const float *mapX, global const float *mapY)
 {
-  const uint i = get_global_id(0);
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
 
   const float x = mapX[i];
   const float y = mapY[i];
   const int xL = (int)floor(x);
-  const int xH = xL + 1;
   const int yL = (int)floor(y);
-  const int yH = yL + 1;
 
-  if(xL < 0 || yL < 0 || xH >= widthD || yH >= heightD)
+  if(xL < 0 || yL < 0 || xL + 1 >= widthD || yL + 1 >= heightD)
   {
     out[i] = 0;
     return;
@@ -166,31 +309,74 @@ void kernel remapDepth(global const ushort *in, global ushort *out, global const
   const uint iRB = iLB + 1;
 
   const float4 p = (float4)(in[iLT], in[iRT], in[iLB], in[iRB]);
-  int4 valid = isgreaterequal(p, (float4)(1));
-  int count = abs(valid.s0 + valid.s1 + valid.s2 + valid.s3);
+  out[i] = interpolateDepth(p, x, y, xL, yL);
+}
 
-  if(count < 3)
+// remap depth image stored in an image object, the neighborhood is read through the texture cache
+const sampler_t samplerDepth = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+
+void kernel remapDepthImage(read_only image2d_t in, global ushort *out, global const float *mapX, global const float *mapY)
+{
+  const uint i = get_global_id(1) * widthR + get_global_id(0);
+
+  const float x = mapX[i];
+  const float y = mapY[i];
+  const int xL = (int)floor(x);
+  const int yL = (int)floor(y);
+
+  if(xL < 0 || yL < 0 || xL + 1 >= widthD || yL + 1 >= heightD)
   {
     out[i] = 0;
     return;
   }
 
-  const float avg = (p.s0 + p.s1 + p.s2 + p.s3) / count;
-  const float thres = 0.01 * avg;
-  valid = isless(fabs(p - avg), (float4)(thres));
-  count = abs(valid.s0 + valid.s1 + valid.s2 + valid.s3);
+  const float4 p = (float4)(read_imageui(in, samplerDepth, (int2)(xL, yL)).x, read_imageui(in, samplerDepth, (int2)(xL + 1, yL)).x,
+                            read_imageui(in, samplerDepth, (int2)(xL, yL + 1)).x, read_imageui(in, samplerDepth, (int2)(xL + 1, yL + 1)).x);
+  out[i] = interpolateDepth(p, x, y, xL, yL);
+}
 
-  if(count < 3)
+// fill holes of the registered depth image with a joint bilateral filter guided by the color image
+void kernel fillHoles(global const ushort *in, global const uchar *color, global const float *spatial, global const float *range, global ushort *out, const int radius)
+{
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+  const uint i = y * widthR + x;
+
+  const ushort d = in[i];
+  if(d)
   {
-    out[i] = 0;
+    out[i] = d;
     return;
   }
 
-  const float4 distXY = (float4)((x - xL) * (x - xL), (xH - x) * (xH - x), (y - yL) * (y - yL), (yH - y) * (yH - y));
-  const float4 tmp = (float4)(sqrt(2.0));
-  const float4 dist2 = (float4)(distXY.s0 + distXY.s2, distXY.s1 + distXY.s2, distXY.s0 + distXY.s3, distXY.s1 + distXY.s3);
-  const float4 dist = select((float4)(0), tmp - sqrt(dist2), valid);
-  const float sum = dist.s0 + dist.s1 + dist.s2 + dist.s3;
+  const int xL = max(x - radius, 0);
+  const int xH = min(x + radius, widthR - 1);
+  const int yL = max(y - radius, 0);
+  const int yH = min(y + radius, heightR - 1);
+  const int size = 2 * radius + 1;
+
+  const int3 center = convert_int3(vload3(i, color));
+  float sumDepth = 0, sumWeight = 0;
+
+  for(int yN = yL; yN <= yH; ++yN)
+  {
+    const int rowN = yN * widthR;
+    const int rowS = (yN - y + radius) * size + radius - x;
+
+    for(int xN = xL; xN <= xH; ++xN)
+    {
+      const ushort dN = in[rowN + xN];
+      if(!dN)
+      {
+        continue;
+      }
+
+      const uint3 diff = abs(center - convert_int3(vload3(rowN + xN, color)));
+      const float weight = spatial[rowS + xN] * range[diff.x + diff.y + diff.z];
+      sumDepth += weight * dN;
+      sumWeight += weight;
+    }
+  }
 
-  out[i] = (dot(p, dist) / sum) + 0.5;
+  out[i] = sumWeight > 1e-3f ? (ushort)(sumDepth / sumWeight + 0.5f) : 0;
 }
@@ -15,12 +15,273 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cstdlib>
+
 #include "depth_registration_cpu.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define DEPTH_REG_CPU_X86
+#include <immintrin.h>
+#endif
+
 #define OUT_NAME(FUNCTION) "[DepthRegistrationCPU::" FUNCTION "] "
 
-DepthRegistrationCPU::DepthRegistrationCPU()
-  : DepthRegistration()
+// Tile sizes of the incremental mode in pixels of the registered and of the depth image
+#define TILE_REGISTERED 32
+#define TILE_DEPTH 16
+
+#ifdef DEPTH_REG_CPU_X86
+// Vectorized versions of DepthRegistrationCPU::interpolate. The four neighbours are fetched with scalar loads, everything else
+// (bounds and validity checks, weights and the weighted average) is computed in float for 4 (SSE4.1) or 8 (AVX2) pixels at once.
+// The validity checks are exact integer arithmetic in float, so only the final weighting differs from the double precision path.
+__attribute__((target("sse4.1")))
+static inline __m128i interpolateSSE41(const cv::Mat &in, const __m128 x, const __m128 y)
+{
+  const __m128 fxL = _mm_floor_ps(x);
+  const __m128 fxH = _mm_ceil_ps(x);
+  const __m128 fyL = _mm_floor_ps(y);
+  const __m128 fyH = _mm_ceil_ps(y);
+  __m128i xL = _mm_cvtps_epi32(fxL);
+  __m128i xH = _mm_cvtps_epi32(fxH);
+  __m128i yL = _mm_cvtps_epi32(fyL);
+  __m128i yH = _mm_cvtps_epi32(fyH);
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i minusOne = _mm_set1_epi32(-1);
+  __m128i inside = _mm_and_si128(_mm_cmpgt_epi32(xL, minusOne), _mm_cmpgt_epi32(yL, minusOne));
+  inside = _mm_and_si128(inside, _mm_cmpgt_epi32(_mm_set1_epi32(in.cols), xH));
+  inside = _mm_and_si128(inside, _mm_cmpgt_epi32(_mm_set1_epi32(in.rows), yH));
+
+  if(_mm_testz_si128(inside, inside))
+  {
+    return zero;
+  }
+
+  // Out of bounds lanes read pixel (0, 0) and are masked out at the end
+  xL = _mm_and_si128(xL, inside);
+  xH = _mm_and_si128(xH, inside);
+  yL = _mm_and_si128(yL, inside);
+  yH = _mm_and_si128(yH, inside);
+
+  alignas(16) int32_t iXL[4], iXH[4], iYL[4], iYH[4];
+  alignas(16) int32_t iLT[4], iRT[4], iLB[4], iRB[4];
+  _mm_store_si128((__m128i *)iXL, xL);
+  _mm_store_si128((__m128i *)iXH, xH);
+  _mm_store_si128((__m128i *)iYL, yL);
+  _mm_store_si128((__m128i *)iYH, yH);
+  for(int i = 0; i < 4; ++i)
+  {
+    const uint16_t *rowL = in.ptr<uint16_t>(iYL[i]);
+    const uint16_t *rowH = in.ptr<uint16_t>(iYH[i]);
+    iLT[i] = rowL[iXL[i]];
+    iRT[i] = rowL[iXH[i]];
+    iLB[i] = rowH[iXL[i]];
+    iRB[i] = rowH[iXH[i]];
+  }
+  const __m128 pLT = _mm_cvtepi32_ps(_mm_load_si128((const __m128i *)iLT));
+  const __m128 pRT = _mm_cvtepi32_ps(_mm_load_si128((const __m128i *)iRT));
+  const __m128 pLB = _mm_cvtepi32_ps(_mm_load_si128((const __m128i *)iLB));
+  const __m128 pRB = _mm_cvtepi32_ps(_mm_load_si128((const __m128i *)iRB));
+
+  const __m128 zeroF = _mm_setzero_ps();
+  const __m128 oneF = _mm_set1_ps(1.0f);
+  const __m128 threeF = _mm_set1_ps(3.0f);
+
+  // At least 3 of 4 neighbours have to be valid
+  __m128 count = _mm_and_ps(_mm_cmpgt_ps(pLT, zeroF), oneF);
+  count = _mm_add_ps(count, _mm_and_ps(_mm_cmpgt_ps(pRT, zeroF), oneF));
+  count = _mm_add_ps(count, _mm_and_ps(_mm_cmpgt_ps(pLB, zeroF), oneF));
+  count = _mm_add_ps(count, _mm_and_ps(_mm_cmpgt_ps(pRB, zeroF), oneF));
+  __m128 valid = _mm_cmpge_ps(count, threeF);
+
+  // Integer average and 1% threshold, exact for all 16 bit values
+  const __m128 sum = _mm_add_ps(_mm_add_ps(pLT, pRT), _mm_add_ps(pLB, pRB));
+  const __m128 avg = _mm_floor_ps(_mm_div_ps(sum, _mm_max_ps(count, oneF)));
+  const __m128 thres = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(avg, _mm_set1_ps(0.01f)), _mm_set1_ps(1e-4f)));
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  const __m128 vLT = _mm_cmplt_ps(_mm_and_ps(_mm_sub_ps(pLT, avg), absMask), thres);
+  const __m128 vRT = _mm_cmplt_ps(_mm_and_ps(_mm_sub_ps(pRT, avg), absMask), thres);
+  const __m128 vLB = _mm_cmplt_ps(_mm_and_ps(_mm_sub_ps(pLB, avg), absMask), thres);
+  const __m128 vRB = _mm_cmplt_ps(_mm_and_ps(_mm_sub_ps(pRB, avg), absMask), thres);
+  count = _mm_add_ps(_mm_add_ps(_mm_and_ps(vLT, oneF), _mm_and_ps(vRT, oneF)), _mm_add_ps(_mm_and_ps(vLB, oneF), _mm_and_ps(vRB, oneF)));
+  valid = _mm_and_ps(valid, _mm_cmpge_ps(count, threeF));
+  valid = _mm_and_ps(valid, _mm_castsi128_ps(inside));
+
+  __m128 distXL = _mm_sub_ps(x, fxL);
+  __m128 distXH = _mm_sub_ps(oneF, distXL);
+  __m128 distYL = _mm_sub_ps(y, fyL);
+  __m128 distYH = _mm_sub_ps(oneF, distYL);
+  distXL = _mm_mul_ps(distXL, distXL);
+  distXH = _mm_mul_ps(distXH, distXH);
+  distYL = _mm_mul_ps(distYL, distYL);
+  distYH = _mm_mul_ps(distYH, distYH);
+  const __m128 tmp = _mm_set1_ps(1.41421356f);
+  const __m128 fLT = _mm_and_ps(vLT, _mm_sub_ps(tmp, _mm_sqrt_ps(_mm_add_ps(distXL, distYL))));
+  const __m128 fRT = _mm_and_ps(vRT, _mm_sub_ps(tmp, _mm_sqrt_ps(_mm_add_ps(distXH, distYL))));
+  const __m128 fLB = _mm_and_ps(vLB, _mm_sub_ps(tmp, _mm_sqrt_ps(_mm_add_ps(distXL, distYH))));
+  const __m128 fRB = _mm_and_ps(vRB, _mm_sub_ps(tmp, _mm_sqrt_ps(_mm_add_ps(distXH, distYH))));
+  const __m128 fSum = _mm_add_ps(_mm_add_ps(fLT, fRT), _mm_add_ps(fLB, fRB));
+
+  __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pLT, fLT), _mm_mul_ps(pRT, fRT)), _mm_add_ps(_mm_mul_ps(pLB, fLB), _mm_mul_ps(pRB, fRB)));
+  value = _mm_add_ps(_mm_div_ps(value, _mm_max_ps(fSum, _mm_set1_ps(1e-6f))), _mm_set1_ps(0.5f));
+  return _mm_cvttps_epi32(_mm_and_ps(valid, value));
+}
+
+__attribute__((target("sse4.1")))
+static void remapRowSSE41(const cv::Mat &in, const float *itX, const float *itY, uint16_t *itO, const size_t width)
+{
+  size_t c = 0;
+  for(; c + 8 <= width; c += 8)
+  {
+    const __m128i lo = interpolateSSE41(in, _mm_loadu_ps(itX + c), _mm_loadu_ps(itY + c));
+    const __m128i hi = interpolateSSE41(in, _mm_loadu_ps(itX + c + 4), _mm_loadu_ps(itY + c + 4));
+    _mm_storeu_si128((__m128i *)(itO + c), _mm_packus_epi32(lo, hi));
+  }
+  for(; c < width; c += 4)
+  {
+    // Pad the remaining pixels with coordinates outside of the image
+    alignas(16) float x[4] = {-1, -1, -1, -1};
+    alignas(16) float y[4] = {-1, -1, -1, -1};
+    alignas(16) uint16_t out[8];
+    const size_t count = std::min<size_t>(4, width - c);
+    std::copy(itX + c, itX + c + count, x);
+    std::copy(itY + c, itY + c + count, y);
+    const __m128i value = interpolateSSE41(in, _mm_load_ps(x), _mm_load_ps(y));
+    _mm_store_si128((__m128i *)out, _mm_packus_epi32(value, value));
+    std::copy(out, out + count, itO + c);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i interpolateAVX2(const cv::Mat &in, const __m256 x, const __m256 y)
+{
+  const __m256 fxL = _mm256_floor_ps(x);
+  const __m256 fxH = _mm256_ceil_ps(x);
+  const __m256 fyL = _mm256_floor_ps(y);
+  const __m256 fyH = _mm256_ceil_ps(y);
+  __m256i xL = _mm256_cvtps_epi32(fxL);
+  __m256i xH = _mm256_cvtps_epi32(fxH);
+  __m256i yL = _mm256_cvtps_epi32(fyL);
+  __m256i yH = _mm256_cvtps_epi32(fyH);
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i minusOne = _mm256_set1_epi32(-1);
+  __m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(xL, minusOne), _mm256_cmpgt_epi32(yL, minusOne));
+  inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_set1_epi32(in.cols), xH));
+  inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_set1_epi32(in.rows), yH));
+
+  if(_mm256_testz_si256(inside, inside))
+  {
+    return zero;
+  }
+
+  // Out of bounds lanes read pixel (0, 0) and are masked out at the end
+  xL = _mm256_and_si256(xL, inside);
+  xH = _mm256_and_si256(xH, inside);
+  yL = _mm256_and_si256(yL, inside);
+  yH = _mm256_and_si256(yH, inside);
+
+  alignas(32) int32_t iXL[8], iXH[8], iYL[8], iYH[8];
+  alignas(32) int32_t iLT[8], iRT[8], iLB[8], iRB[8];
+  _mm256_store_si256((__m256i *)iXL, xL);
+  _mm256_store_si256((__m256i *)iXH, xH);
+  _mm256_store_si256((__m256i *)iYL, yL);
+  _mm256_store_si256((__m256i *)iYH, yH);
+  for(int i = 0; i < 8; ++i)
+  {
+    const uint16_t *rowL = in.ptr<uint16_t>(iYL[i]);
+    const uint16_t *rowH = in.ptr<uint16_t>(iYH[i]);
+    iLT[i] = rowL[iXL[i]];
+    iRT[i] = rowL[iXH[i]];
+    iLB[i] = rowH[iXL[i]];
+    iRB[i] = rowH[iXH[i]];
+  }
+  const __m256 pLT = _mm256_cvtepi32_ps(_mm256_load_si256((const __m256i *)iLT));
+  const __m256 pRT = _mm256_cvtepi32_ps(_mm256_load_si256((const __m256i *)iRT));
+  const __m256 pLB = _mm256_cvtepi32_ps(_mm256_load_si256((const __m256i *)iLB));
+  const __m256 pRB = _mm256_cvtepi32_ps(_mm256_load_si256((const __m256i *)iRB));
+
+  const __m256 zeroF = _mm256_setzero_ps();
+  const __m256 oneF = _mm256_set1_ps(1.0f);
+  const __m256 threeF = _mm256_set1_ps(3.0f);
+
+  // At least 3 of 4 neighbours have to be valid
+  __m256 count = _mm256_and_ps(_mm256_cmp_ps(pLT, zeroF, _CMP_GT_OQ), oneF);
+  count = _mm256_add_ps(count, _mm256_and_ps(_mm256_cmp_ps(pRT, zeroF, _CMP_GT_OQ), oneF));
+  count = _mm256_add_ps(count, _mm256_and_ps(_mm256_cmp_ps(pLB, zeroF, _CMP_GT_OQ), oneF));
+  count = _mm256_add_ps(count, _mm256_and_ps(_mm256_cmp_ps(pRB, zeroF, _CMP_GT_OQ), oneF));
+  __m256 valid = _mm256_cmp_ps(count, threeF, _CMP_GE_OQ);
+
+  // Integer average and 1% threshold, exact for all 16 bit values
+  const __m256 sum = _mm256_add_ps(_mm256_add_ps(pLT, pRT), _mm256_add_ps(pLB, pRB));
+  const __m256 avg = _mm256_floor_ps(_mm256_div_ps(sum, _mm256_max_ps(count, oneF)));
+  const __m256 thres = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(avg, _mm256_set1_ps(0.01f)), _mm256_set1_ps(1e-4f)));
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+  const __m256 vLT = _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(pLT, avg), absMask), thres, _CMP_LT_OQ);
+  const __m256 vRT = _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(pRT, avg), absMask), thres, _CMP_LT_OQ);
+  const __m256 vLB = _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(pLB, avg), absMask), thres, _CMP_LT_OQ);
+  const __m256 vRB = _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(pRB, avg), absMask), thres, _CMP_LT_OQ);
+  count = _mm256_add_ps(_mm256_add_ps(_mm256_and_ps(vLT, oneF), _mm256_and_ps(vRT, oneF)), _mm256_add_ps(_mm256_and_ps(vLB, oneF), _mm256_and_ps(vRB, oneF)));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(count, threeF, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_castsi256_ps(inside));
+
+  __m256 distXL = _mm256_sub_ps(x, fxL);
+  __m256 distXH = _mm256_sub_ps(oneF, distXL);
+  __m256 distYL = _mm256_sub_ps(y, fyL);
+  __m256 distYH = _mm256_sub_ps(oneF, distYL);
+  distXL = _mm256_mul_ps(distXL, distXL);
+  distXH = _mm256_mul_ps(distXH, distXH);
+  distYL = _mm256_mul_ps(distYL, distYL);
+  distYH = _mm256_mul_ps(distYH, distYH);
+  const __m256 tmp = _mm256_set1_ps(1.41421356f);
+  const __m256 fLT = _mm256_and_ps(vLT, _mm256_sub_ps(tmp, _mm256_sqrt_ps(_mm256_add_ps(distXL, distYL))));
+  const __m256 fRT = _mm256_and_ps(vRT, _mm256_sub_ps(tmp, _mm256_sqrt_ps(_mm256_add_ps(distXH, distYL))));
+  const __m256 fLB = _mm256_and_ps(vLB, _mm256_sub_ps(tmp, _mm256_sqrt_ps(_mm256_add_ps(distXL, distYH))));
+  const __m256 fRB = _mm256_and_ps(vRB, _mm256_sub_ps(tmp, _mm256_sqrt_ps(_mm256_add_ps(distXH, distYH))));
+  const __m256 fSum = _mm256_add_ps(_mm256_add_ps(fLT, fRT), _mm256_add_ps(fLB, fRB));
+
+  __m256 value = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pLT, fLT), _mm256_mul_ps(pRT, fRT)), _mm256_add_ps(_mm256_mul_ps(pLB, fLB), _mm256_mul_ps(pRB, fRB)));
+  value = _mm256_add_ps(_mm256_div_ps(value, _mm256_max_ps(fSum, _mm256_set1_ps(1e-6f))), _mm256_set1_ps(0.5f));
+  return _mm256_cvttps_epi32(_mm256_and_ps(valid, value));
+}
+
+__attribute__((target("avx2")))
+static inline __m128i packAVX2(const __m256i value)
+{
+  // packus works per 128 bit lane, so bring the 4 results of each lane together afterwards
+  const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(value, value), 0x08);
+  return _mm256_castsi256_si128(packed);
+}
+
+__attribute__((target("avx2")))
+static void remapRowAVX2(const cv::Mat &in, const float *itX, const float *itY, uint16_t *itO, const size_t width)
+{
+  size_t c = 0;
+  for(; c + 8 <= width; c += 8)
+  {
+    const __m256i value = interpolateAVX2(in, _mm256_loadu_ps(itX + c), _mm256_loadu_ps(itY + c));
+    _mm_storeu_si128((__m128i *)(itO + c), packAVX2(value));
+  }
+  if(c < width)
+  {
+    // Pad the remaining pixels with coordinates outside of the image
+    alignas(32) float x[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    alignas(32) float y[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    alignas(16) uint16_t out[8];
+    const size_t count = width - c;
+    std::copy(itX + c, itX + c + count, x);
+    std::copy(itY + c, itY + c + count, y);
+    const __m256i value = interpolateAVX2(in, _mm256_load_ps(x), _mm256_load_ps(y));
+    _mm_store_si128((__m128i *)out, packAVX2(value));
+    std::copy(out, out + count, itO + c);
+  }
+}
+#endif
+
+DepthRegistrationCPU::DepthRegistrationCPU(const Mode mode, const bool doublePrecision)
+  : DepthRegistration(), mode(mode), doublePrecision(doublePrecision), remapRow(&DepthRegistrationCPU::remapRowScalar),
+    incrementalTargets(0), incrementalValid(false)
 {
 }
 
@@ -30,34 +291,171 @@ DepthRegistrationCPU::~DepthRegistrationCPU()
 
 bool DepthRegistrationCPU::init(const int deviceId)
 {
-  createLookup();
-
-  proj(0, 0) = rotation.at<double>(0, 0);
-  proj(0, 1) = rotation.at<double>(0, 1);
-  proj(0, 2) = rotation.at<double>(0, 2);
-  proj(0, 3) = translation.at<double>(0, 0);
-  proj(1, 0) = rotation.at<double>(1, 0);
-  proj(1, 1) = rotation.at<double>(1, 1);
-  proj(1, 2) = rotation.at<double>(1, 2);
-  proj(1, 3) = translation.at<double>(1, 0);
-  proj(2, 0) = rotation.at<double>(2, 0);
-  proj(2, 1) = rotation.at<double>(2, 1);
-  proj(2, 2) = rotation.at<double>(2, 2);
-  proj(2, 3) = translation.at<double>(2, 0);
-  proj(3, 0) = 0;
-  proj(3, 1) = 0;
-  proj(3, 2) = 0;
-  proj(3, 3) = 1;
-
-  fx = cameraMatrixRegistered.at<double>(0, 0);
-  fy = cameraMatrixRegistered.at<double>(1, 1);
-  cx = cameraMatrixRegistered.at<double>(0, 2) + 0.5;
-  cy = cameraMatrixRegistered.at<double>(1, 2) + 0.5;
+  initProjection(projFloat);
+  initProjection(projDouble);
+  allocateBuffers();
+  initTiles();
+
+  remapRow = remapKernel(REMAP_AVX2);
+  if(!remapRow)
+  {
+    remapRow = remapKernel(REMAP_SSE41);
+  }
+  if(!remapRow)
+  {
+    remapRow = remapKernel(REMAP_SCALAR);
+  }
+  return true;
+}
+
+DepthRegistrationCPU::RemapRowFunc DepthRegistrationCPU::remapKernel(const RemapKernel kernel)
+{
+  switch(kernel)
+  {
+  case REMAP_SCALAR:
+    return &DepthRegistrationCPU::remapRowScalar;
+#ifdef DEPTH_REG_CPU_X86
+  case REMAP_SSE41:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1") ? &remapRowSSE41 : NULL;
+  case REMAP_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? &remapRowAVX2 : NULL;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+bool DepthRegistrationCPU::initTarget(const size_t index)
+{
+  projFloat.targets.push_back(Target<float>());
+  initTarget(projFloat.targets.back(), cameraMatrixTargets[index], sizeTargets[index]);
+  projDouble.targets.push_back(Target<double>());
+  initTarget(projDouble.targets.back(), cameraMatrixTargets[index], sizeTargets[index]);
+  return true;
+}
 
+bool DepthRegistrationCPU::calibrationChanged()
+{
+  // Resets the projections to the registered camera model, the targets are added again with the new rotation and translation
+  initProjection(projFloat);
+  initProjection(projDouble);
+
+  for(size_t i = 0; i < sizeTargets.size(); ++i)
+  {
+    initTarget(i);
+  }
+  initTiles();
   return true;
 }
 
-inline uint16_t DepthRegistrationCPU::interpolate(const cv::Mat &in, const float &x, const float &y) const
+void DepthRegistrationCPU::allocateBuffers()
+{
+  // Per thread row buffers, create() does nothing if the size did not change
+  const int threads = threadCount();
+  bufferRow.create(threads, sizeRegistered.width, CV_16U);
+  bufferPoints.create(threads, sizeRegistered.width * 3 * sizeof(double), CV_8U);
+  bufferIndex.create(threads, sizeRegistered.width, CV_32S);
+  bufferValues.create(threads, sizeRegistered.width, CV_16U);
+
+  if(mode == TWO_PASS || mode == INCREMENTAL)
+  {
+    scaled.create(sizeRegistered, CV_16U);
+  }
+}
+
+void DepthRegistrationCPU::initTiles()
+{
+  incrementalValid = false;
+  if(mode != INCREMENTAL)
+  {
+    return;
+  }
+
+  tilesDepth = cv::Size((sizeDepth.width + TILE_DEPTH - 1) / TILE_DEPTH, (sizeDepth.height + TILE_DEPTH - 1) / TILE_DEPTH);
+  tilesRegistered = cv::Size((sizeRegistered.width + TILE_REGISTERED - 1) / TILE_REGISTERED,
+                             (sizeRegistered.height + TILE_REGISTERED - 1) / TILE_REGISTERED);
+  dirtyDepthTiles.assign(tilesDepth.area(), 0);
+  tiles.resize(tilesRegistered.area());
+
+  for(int ty = 0, i = 0; ty < tilesRegistered.height; ++ty)
+  {
+    for(int tx = 0; tx < tilesRegistered.width; ++tx, ++i)
+    {
+      Tile &tile = tiles[i];
+      const int x = tx * TILE_REGISTERED;
+      const int y = ty * TILE_REGISTERED;
+      tile.rect = cv::Rect(x, y, std::min(TILE_REGISTERED, sizeRegistered.width - x), std::min(TILE_REGISTERED, sizeRegistered.height - y));
+
+      // The interpolation reads the pixels around the floor and ceil of the mapped coordinates
+      float xL = sizeDepth.width, xH = 0, yL = sizeDepth.height, yH = 0;
+      for(int r = tile.rect.y; r < tile.rect.y + tile.rect.height; ++r)
+      {
+        const float *itX = mapX.ptr<float>(r);
+        const float *itY = mapY.ptr<float>(r);
+        for(int c = tile.rect.x; c < tile.rect.x + tile.rect.width; ++c)
+        {
+          xL = std::min(xL, itX[c]);
+          xH = std::max(xH, itX[c]);
+          yL = std::min(yL, itY[c]);
+          yH = std::max(yH, itY[c]);
+        }
+      }
+      const int x0 = std::min(std::max((int)std::floor(xL), 0), sizeDepth.width - 1) / TILE_DEPTH;
+      const int y0 = std::min(std::max((int)std::floor(yL), 0), sizeDepth.height - 1) / TILE_DEPTH;
+      const int x1 = std::min(std::max((int)std::ceil(xH), 0), sizeDepth.width - 1) / TILE_DEPTH;
+      const int y1 = std::min(std::max((int)std::ceil(yH), 0), sizeDepth.height - 1) / TILE_DEPTH;
+      tile.depthTiles = cv::Rect(x0, y0, std::max(x1 - x0 + 1, 1), std::max(y1 - y0 + 1, 1));
+      tile.footprints.clear();
+      tile.dirty = false;
+    }
+  }
+}
+
+template<typename T>
+void DepthRegistrationCPU::initProjection(Projection<T> &projection) const
+{
+  for(int r = 0; r < 3; ++r)
+  {
+    for(int c = 0; c < 3; ++c)
+    {
+      projection.proj(r, c) = rotation.at<double>(r, c);
+    }
+    projection.proj(r, 3) = translation.at<double>(r, 0);
+  }
+
+  projection.targets.resize(1);
+  initTarget(projection.targets[0], cameraMatrixRegistered, sizeRegistered);
+
+  createLookup(projection);
+
+  if(mode == SPARSE)
+  {
+    createRays(projection);
+  }
+}
+
+template<typename T>
+void DepthRegistrationCPU::initTarget(Target<T> &target, const cv::Mat &cameraMatrix, const cv::Size &size) const
+{
+  target.size = size;
+  target.fx = cameraMatrix.at<double>(0, 0);
+  target.fy = cameraMatrix.at<double>(1, 1);
+  target.cx = cameraMatrix.at<double>(0, 2) + 0.5;
+  target.cy = cameraMatrix.at<double>(1, 2) + 0.5;
+  target.offsetX = 0;
+  target.offsetY = 0;
+
+  // Lower resolution targets only use every n-th row and column of the registered resolution
+  target.step = std::max(1, (int)std::floor(cameraMatrixRegistered.at<double>(0, 0) / cameraMatrix.at<double>(0, 0) + 0.01));
+
+  // Half size of a depth pixel in the target image at the same distance
+  target.splatX = 0.5 * cameraMatrix.at<double>(0, 0) / cameraMatrixDepth.at<double>(0, 0);
+  target.splatY = 0.5 * cameraMatrix.at<double>(1, 1) / cameraMatrixDepth.at<double>(1, 1);
+}
+
+inline uint16_t DepthRegistrationCPU::interpolate(const cv::Mat &in, const float &x, const float &y)
 {
   const int xL = (int)floor(x);
   const int xH = (int)ceil(x);
@@ -115,90 +513,650 @@ inline uint16_t DepthRegistrationCPU::interpolate(const cv::Mat &in, const float
   return ((pLT * fLT +  pRT * fRT + pLB * fLB + pRB * fRB) / sum) + 0.5;
 }
 
-void DepthRegistrationCPU::remapDepth(const cv::Mat &depth, cv::Mat &scaled) const
+void DepthRegistrationCPU::remapRowScalar(const cv::Mat &in, const float *itX, const float *itY, uint16_t *itO, const size_t width)
+{
+  for(size_t c = 0; c < width; ++c, ++itO, ++itX, ++itY)
+  {
+    *itO = interpolate(in, *itX, *itY);
+  }
+}
+
+// Keeps the nearest depth value. Different rows can project onto the same pixel, so the compare and write has to be atomic.
+// The result is the minimum of all values written to the pixel and therefore does not depend on the order of the threads.
+static inline void updateDepth(uint16_t &zReg, const uint16_t z16)
+{
+  uint16_t current = __atomic_load_n(&zReg, __ATOMIC_RELAXED);
+  while((current == 0 || z16 < current) && !__atomic_compare_exchange_n(&zReg, &current, z16, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+void DepthRegistrationCPU::remapDepth(const cv::Mat &depth, cv::Mat &scaled, const cv::Rect &region) const
 {
   scaled.create(sizeRegistered, CV_16U);
-  #pragma omp parallel for
-  for(size_t r = 0; r < (size_t)sizeRegistered.height; ++r)
+  parallelFor(region.height, [&](const int i, const int)
   {
-    uint16_t *itO = scaled.ptr<uint16_t>(r);
-    const float *itX = mapX.ptr<float>(r);
-    const float *itY = mapY.ptr<float>(r);
-    for(size_t c = 0; c < (size_t)sizeRegistered.width; ++c, ++itO, ++itX, ++itY)
+    const int r = region.y + i;
+    remapRow(depth, mapX.ptr<float>(r) + region.x, mapY.ptr<float>(r) + region.x, scaled.ptr<uint16_t>(r) + region.x, region.width);
+  });
+}
+
+template<typename T>
+void DepthRegistrationCPU::projectDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &scaled, cv::Mat *registered,
+                                        const size_t count, const cv::Rect &region)
+{
+  clearRegistered(targets, registered, count);
+
+  parallelFor(region.height, [&](const int i, const int id)
+  {
+    const int r = region.y + i;
+    projectRow(projection, targets, scaled.ptr<uint16_t>(r) + region.x, r, region, bufferPoints.ptr<T>(id), bufferIndex.ptr<int>(id),
+               bufferValues.ptr<uint16_t>(id), registered, count);
+  });
+}
+
+template<typename T>
+void DepthRegistrationCPU::remapProjectDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                                             const size_t count, const cv::Rect &region)
+{
+  clearRegistered(targets, registered, count);
+
+  // Each thread remaps a single row into a small buffer that stays in cache and projects it right away
+  parallelFor(region.height, [&](const int i, const int id)
+  {
+    const int r = region.y + i;
+    uint16_t *scaledRow = bufferRow.ptr<uint16_t>(id);
+    remapRow(depth, mapX.ptr<float>(r) + region.x, mapY.ptr<float>(r) + region.x, scaledRow, region.width);
+    projectRow(projection, targets, scaledRow, r, region, bufferPoints.ptr<T>(id), bufferIndex.ptr<int>(id), bufferValues.ptr<uint16_t>(id),
+               registered, count);
+  });
+}
+
+// itD points to the first pixel of the region in row r
+template<typename T>
+void DepthRegistrationCPU::projectRow(const Projection<T> &projection, const Target<T> *targets, const uint16_t *itD, const size_t r,
+                                      const cv::Rect &region, T *points, int *index, uint16_t *values, cv::Mat *registered, const size_t count,
+                                      cv::Rect *footprints) const
+{
+  const int width = region.width;
+  const T near = zNear;
+  const T far = zFar;
+  const T *itX = &projection.lookupX[region.x];
+  T *itPX = points;
+  T *itPY = points + width;
+  T *itPZ = points + 2 * width;
+
+  // The y component of the ray is constant for the row, so fold it into the offsets
+  const T y = projection.lookupY[r];
+  const T r00 = projection.proj(0, 0), r10 = projection.proj(1, 0), r20 = projection.proj(2, 0);
+  const T oX = projection.proj(0, 1) * y + projection.proj(0, 2);
+  const T oY = projection.proj(1, 1) * y + projection.proj(1, 2);
+  const T oZ = projection.proj(2, 1) * y + projection.proj(2, 2);
+  const T tX = projection.proj(0, 3), tY = projection.proj(1, 3), tZ = projection.proj(2, 3);
+
+  // Branch free and without early exits, so that the compiler can vectorize it. Invalid points get a z of 0.
+  for(int c = 0; c < width; ++c)
+  {
+    const T depthValue = itD[c] / (T)1000;
+    const T x = itX[c];
+    const bool valid = (depthValue >= near) & (depthValue <= far);
+
+    itPX[c] = (r00 * x + oX) * depthValue + tX;
+    itPY[c] = (r10 * x + oY) * depthValue + tY;
+    itPZ[c] = valid ? (r20 * x + oZ) * depthValue + tZ : 0;
+  }
+
+  // The transformed points are shared by all targets, only the projection differs
+  for(size_t t = 0; t < count; ++t)
+  {
+    const Target<T> &target = targets[t];
+    const int step = target.step;
+    if(r % step)
     {
-      *itO = interpolate(depth, *itX, *itY);
+      continue;
+    }
+
+    const int widthT = target.size.width;
+    const int heightT = target.size.height;
+    // Columns are sampled at multiples of the step in the whole image, also for regions starting in between
+    const int first = (step - region.x % step) % step;
+    const int size = width > first ? (width - first + step - 1) / step : 0;
+    const T fx = target.fx;
+    const T fy = target.fy;
+    const T cx = target.cx;
+    const T cy = target.cy;
+    const int offsetX = target.offsetX;
+    const int offsetY = target.offsetY;
+
+    for(int i = 0; i < size; ++i)
+    {
+      const int c = first + i * step;
+      const T pZ = itPZ[c];
+      const T invZ = 1 / pZ;
+      const T x = (fx * itPX[c]) * invZ + cx;
+      const T y = (fy * itPY[c]) * invZ + cy;
+      const int xP = (int)x - offsetX;
+      const int yP = (int)y - offsetY;
+      const int zP = pZ * 1000;
+
+      // The conversion truncates towards zero, so the coordinates have to be checked before it
+      const bool valid = (pZ > 0) & (x >= 0) & (y >= 0) & (xP >= 0) & (xP < widthT) & (yP >= 0) & (yP < heightT);
+      index[i] = valid ? yP * widthT + xP : -1;
+      values[i] = valid ? zP : 0;
+    }
+
+    uint16_t *itR = registered[t].ptr<uint16_t>();
+    for(int i = 0; i < size; ++i)
+    {
+      if(index[i] >= 0)
+      {
+        updateDepth(itR[index[i]], values[i]);
+      }
+    }
+
+    // Adds the bounding box of the written pixels to the footprint of the target
+    if(footprints)
+    {
+      cv::Rect *footprint = &footprints[t];
+      int xL = widthT, xH = -1, yL = heightT, yH = -1;
+      for(int i = 0; i < size; ++i)
+      {
+        if(index[i] >= 0)
+        {
+          const int xP = index[i] % widthT;
+          const int yP = index[i] / widthT;
+          xL = std::min(xL, xP);
+          xH = std::max(xH, xP);
+          yL = std::min(yL, yP);
+          yH = std::max(yH, yP);
+        }
+      }
+
+      if(xH >= 0 && footprint->area())
+      {
+        xL = std::min(xL, footprint->x);
+        yL = std::min(yL, footprint->y);
+        xH = std::max(xH, footprint->x + footprint->width - 1);
+        yH = std::max(yH, footprint->y + footprint->height - 1);
+      }
+      if(xH >= 0)
+      {
+        *footprint = cv::Rect(xL, yL, xH - xL + 1, yH - yL + 1);
+      }
     }
   }
 }
 
-void DepthRegistrationCPU::projectDepth(const cv::Mat &scaled, cv::Mat &registered) const
+void DepthRegistrationCPU::registerDepth(const cv::Mat &depth, cv::Mat &registered)
 {
-  registered = cv::Mat::zeros(sizeRegistered, CV_16U);
+  allocateBuffers();
+  const cv::Rect region(0, 0, sizeRegistered.width, sizeRegistered.height);
 
-  #pragma omp parallel for
-  for(size_t r = 0; r < (size_t)sizeRegistered.height; ++r)
+  if(mode == INCREMENTAL && doublePrecision)
+  {
+    registerIncremental(projDouble, depth, &registered, 1);
+  }
+  else if(mode == INCREMENTAL)
+  {
+    registerIncremental(projFloat, depth, &registered, 1);
+  }
+  else if(doublePrecision)
+  {
+    registerDepth(projDouble, &projDouble.targets[0], depth, &registered, 1, region);
+  }
+  else
+  {
+    registerDepth(projFloat, &projFloat.targets[0], depth, &registered, 1, region);
+  }
+}
+
+void DepthRegistrationCPU::registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered)
+{
+  allocateBuffers();
+  registered.resize(1 + sizeTargets.size());
+
+  const cv::Rect region(0, 0, sizeRegistered.width, sizeRegistered.height);
+
+  if(mode == INCREMENTAL && doublePrecision)
+  {
+    registerIncremental(projDouble, depth, &registered[0], registered.size());
+  }
+  else if(mode == INCREMENTAL)
+  {
+    registerIncremental(projFloat, depth, &registered[0], registered.size());
+  }
+  else if(doublePrecision)
+  {
+    registerDepth(projDouble, &projDouble.targets[0], depth, &registered[0], registered.size(), region);
+  }
+  else
+  {
+    registerDepth(projFloat, &projFloat.targets[0], depth, &registered[0], registered.size(), region);
+  }
+}
+
+void DepthRegistrationCPU::registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered)
+{
+  if(!checkROI(roi))
+  {
+    return;
+  }
+
+  allocateBuffers();
+
+  if(doublePrecision)
   {
-    const uint16_t *itD = scaled.ptr<uint16_t>(r);
-    const double y = lookupY.at<double>(0, r);
-    const double *itX = lookupX.ptr<double>();
+    registerROI(projDouble, depth, roi, registered);
+  }
+  else
+  {
+    registerROI(projFloat, depth, roi, registered);
+  }
+}
+
+// Only the tiles remapped from changed parts of the depth image are remapped and projected again. Before that, all tiles of the
+// target images they were projected to in the last frame are cleared, and all other tiles that contributed to those are
+// projected again. Pixels outside of the cleared tiles keep the minimum of their unchanged contributions and the new ones, so
+// the result is the same as registering the whole image.
+template<typename T>
+void DepthRegistrationCPU::registerIncremental(const Projection<T> &projection, const cv::Mat &depth, cv::Mat *registered, const size_t count)
+{
+  // Registering into other targets than in the last frame starts over
+  const bool all = !incrementalValid || incrementalTargets != count;
+  if(all)
+  {
+    resetIncremental(projection, depth, count);
+  }
+  else if(!updateReference(depth))
+  {
+    for(size_t t = 0; t < count; ++t)
+    {
+      bufferRegistered[t].copyTo(registered[t]);
+    }
+    return;
+  }
+
+  const int tileCount = (int)tiles.size();
+  parallelFor(tileCount, [&](const int i, const int)
+  {
+    Tile &tile = tiles[i];
+    tile.dirty = all;
+    for(int y = tile.depthTiles.y; y < tile.depthTiles.y + tile.depthTiles.height && !tile.dirty; ++y)
+    {
+      for(int x = tile.depthTiles.x; x < tile.depthTiles.x + tile.depthTiles.width && !tile.dirty; ++x)
+      {
+        tile.dirty = dirtyDepthTiles[y * tilesDepth.width + x] != 0;
+      }
+    }
 
-    for(size_t c = 0; c < (size_t)sizeRegistered.width; ++c, ++itD, ++itX)
+    if(tile.dirty)
     {
-      const double depthValue = *itD / 1000.0;
+      for(int r = tile.rect.y; r < tile.rect.y + tile.rect.height; ++r)
+      {
+        remapRow(referenceDepth, mapX.ptr<float>(r) + tile.rect.x, mapY.ptr<float>(r) + tile.rect.x, scaled.ptr<uint16_t>(r) + tile.rect.x,
+                 tile.rect.width);
+      }
+    }
+  });
 
-      if(depthValue < zNear || depthValue > zFar)
+  for(size_t t = 0; t < count; ++t)
+  {
+    std::vector<uint8_t> &cleared = clearedTiles[t];
+    const cv::Size &tilesTarget = tilesTargets[t];
+    std::fill(cleared.begin(), cleared.end(), 0);
+    for(int i = 0; i < tileCount; ++i)
+    {
+      if(!tiles[i].dirty)
       {
         continue;
       }
+      const cv::Rect range = tileRange(tiles[i].footprints[t], tilesTarget);
+      for(int y = range.y; y < range.y + range.height; ++y)
+      {
+        std::fill(cleared.begin() + y * tilesTarget.width + range.x, cleared.begin() + y * tilesTarget.width + range.x + range.width, 1);
+      }
+    }
+    for(int i = 0; i < tilesTarget.area(); ++i)
+    {
+      if(cleared[i])
+      {
+        bufferRegistered[t](tileRect(i, tilesTarget, bufferRegistered[t].size())).setTo(0);
+      }
+    }
+  }
+
+  parallelFor(tileCount, [&](const int i, const int id)
+  {
+    // A tile is projected into all targets if one of them needs it, which does not change the pixels of the others
+    Tile &tile = tiles[i];
+    bool project = tile.dirty;
+    for(size_t t = 0; t < count && !project; ++t)
+    {
+      const cv::Rect range = tileRange(tile.footprints[t], tilesTargets[t]);
+      for(int y = range.y; y < range.y + range.height && !project; ++y)
+      {
+        for(int x = range.x; x < range.x + range.width && !project; ++x)
+        {
+          project = clearedTiles[t][y * tilesTargets[t].width + x] != 0;
+        }
+      }
+    }
+    if(!project)
+    {
+      return;
+    }
 
-      Eigen::Vector4d pointD(*itX * depthValue, y * depthValue, depthValue, 1);
-      Eigen::Vector4d pointP = proj * pointD;
+    // Tiles that did not change project to the same pixels as before, only the footprints of the changed ones are updated
+    if(tile.dirty)
+    {
+      std::fill(tile.footprints.begin(), tile.footprints.end(), cv::Rect());
+    }
+    for(int r = tile.rect.y; r < tile.rect.y + tile.rect.height; ++r)
+    {
+      projectRow(projection, &projection.targets[0], scaled.ptr<uint16_t>(r) + tile.rect.x, r, tile.rect, bufferPoints.ptr<T>(id),
+                 bufferIndex.ptr<int>(id), bufferValues.ptr<uint16_t>(id), &bufferRegistered[0], count,
+                 tile.dirty ? &tile.footprints[0] : NULL);
+    }
+  }, true);
 
-      const double z = pointP[2];
+  for(size_t t = 0; t < count; ++t)
+  {
+    bufferRegistered[t].copyTo(registered[t]);
+  }
+}
+
+// Starts the incremental registration over with the given number of targets, the buffers are only allocated when they change
+template<typename T>
+void DepthRegistrationCPU::resetIncremental(const Projection<T> &projection, const cv::Mat &depth, const size_t count)
+{
+  depth.copyTo(referenceDepth);
+  bufferRegistered.resize(count);
+  clearedTiles.resize(count);
+  tilesTargets.resize(count);
+  for(size_t t = 0; t < count; ++t)
+  {
+    const cv::Size &size = projection.targets[t].size;
+    bufferRegistered[t].create(size, CV_16U);
+    bufferRegistered[t].setTo(0);
+    tilesTargets[t] = cv::Size((size.width + TILE_REGISTERED - 1) / TILE_REGISTERED, (size.height + TILE_REGISTERED - 1) / TILE_REGISTERED);
+    clearedTiles[t].assign(tilesTargets[t].area(), 0);
+  }
+  for(size_t i = 0; i < tiles.size(); ++i)
+  {
+    tiles[i].footprints.assign(count, cv::Rect());
+  }
+  incrementalTargets = count;
+  incrementalValid = true;
+}
 
-      const double invZ = 1 / z;
-      const int xP = (fx * pointP[0]) * invZ + cx;
-      const int yP = (fy * pointP[1]) * invZ + cy;
+// Marks the depth tiles with a pixel that changed by more than the threshold and copies them into the reference depth image.
+// Smaller changes are not copied, so that they can not add up over several frames.
+bool DepthRegistrationCPU::updateReference(const cv::Mat &depth)
+{
+  const int count = tilesDepth.area();
+  parallelFor(count, [&](const int i, const int)
+  {
+    const int x = (i % tilesDepth.width) * TILE_DEPTH;
+    const int y = (i / tilesDepth.width) * TILE_DEPTH;
+    const int width = std::min(TILE_DEPTH, sizeDepth.width - x);
+    const int height = std::min(TILE_DEPTH, sizeDepth.height - y);
 
-      if(xP >= 0 && xP < sizeRegistered.width && yP >= 0 && yP < sizeRegistered.height)
+    bool dirty = false;
+    for(int r = y; r < y + height && !dirty; ++r)
+    {
+      const uint16_t *itD = depth.ptr<uint16_t>(r) + x;
+      const uint16_t *itR = referenceDepth.ptr<uint16_t>(r) + x;
+      for(int c = 0; c < width; ++c)
+      {
+        dirty |= std::abs(itD[c] - itR[c]) > incrementalThreshold;
+      }
+    }
+
+    if(dirty)
+    {
+      for(int r = y; r < y + height; ++r)
       {
-        const uint16_t z16 = z * 1000;
-        uint16_t &zReg = registered.at<uint16_t>(yP, xP);
-        if(zReg == 0 || z16 < zReg)
+        std::copy(depth.ptr<uint16_t>(r) + x, depth.ptr<uint16_t>(r) + x + width, referenceDepth.ptr<uint16_t>(r) + x);
+      }
+    }
+    dirtyDepthTiles[i] = dirty;
+  });
+  return std::find(dirtyDepthTiles.begin(), dirtyDepthTiles.end(), 1) != dirtyDepthTiles.end();
+}
+
+// Range of tiles of a target image covered by the given rectangle of pixels
+cv::Rect DepthRegistrationCPU::tileRange(const cv::Rect &rect, const cv::Size &tiles)
+{
+  if(rect.width <= 0 || rect.height <= 0)
+  {
+    return cv::Rect();
+  }
+
+  const int x0 = rect.x / TILE_REGISTERED;
+  const int y0 = rect.y / TILE_REGISTERED;
+  const int x1 = (rect.x + rect.width - 1) / TILE_REGISTERED;
+  const int y1 = (rect.y + rect.height - 1) / TILE_REGISTERED;
+  return cv::Rect(x0, y0, std::min(x1, tiles.width - 1) - x0 + 1, std::min(y1, tiles.height - 1) - y0 + 1);
+}
+
+// Pixels of a target image covered by the tile with the given index
+cv::Rect DepthRegistrationCPU::tileRect(const int index, const cv::Size &tiles, const cv::Size &size)
+{
+  const int x = (index % tiles.width) * TILE_REGISTERED;
+  const int y = (index / tiles.width) * TILE_REGISTERED;
+  return cv::Rect(x, y, std::min(TILE_REGISTERED, size.width - x), std::min(TILE_REGISTERED, size.height - y));
+}
+
+template<typename T>
+void DepthRegistrationCPU::registerROI(const Projection<T> &projection, const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered)
+{
+  // The region of interest is a part of the registered image, offset by its top left corner
+  Target<T> target = projection.targets[0];
+  target.size = roi.size();
+  target.offsetX = roi.x;
+  target.offsetY = roi.y;
+
+  // The dense modes round the projection to the nearest pixel. The sparse mode fills the footprint of a depth pixel, which grows
+  // with the ratio of its depths in both cameras, so twice its size is a safe bound.
+  const double reach = mode == SPARSE ? 2.0 * std::max(target.splatX, target.splatY) + 1.0 : 1.0;
+  registerDepth(projection, &target, depth, &registered, 1, sourceRegion(roi, reach));
+}
+
+template<typename T>
+void DepthRegistrationCPU::registerDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                                         const size_t count, const cv::Rect &region)
+{
+  if(mode == FUSED)
+  {
+    remapProjectDepth(projection, targets, depth, registered, count, region);
+    return;
+  }
+  if(mode == SPARSE)
+  {
+    splatDepth(projection, targets, depth, registered, count, depthRegion(region));
+    return;
+  }
+
+  // Also used by the incremental mode for other targets and regions, which replaces its scaled image
+  incrementalValid = false;
+  remapDepth(depth, scaled, region);
+  projectDepth(projection, targets, scaled, registered, count, region);
+}
+
+cv::Rect DepthRegistrationCPU::depthRegion(const cv::Rect &region) const
+{
+  if(region.width == sizeRegistered.width && region.height == sizeRegistered.height)
+  {
+    return cv::Rect(0, 0, sizeDepth.width, sizeDepth.height);
+  }
+
+  // Bounding box of the depth pixels the border of the region is remapped from, the undistortion is monotonic
+  float xL = sizeDepth.width, xH = 0, yL = sizeDepth.height, yH = 0;
+  const int right = region.x + region.width - 1;
+  const int bottom = region.y + region.height - 1;
+  for(int r = region.y; r <= bottom; ++r)
+  {
+    const int step = (r == region.y || r == bottom) ? 1 : region.width - 1;
+    for(int c = region.x; c <= right; c += std::max(step, 1))
+    {
+      const float x = mapX.at<float>(r, c);
+      const float y = mapY.at<float>(r, c);
+      xL = std::min(xL, x);
+      xH = std::max(xH, x);
+      yL = std::min(yL, y);
+      yH = std::max(yH, y);
+    }
+  }
+
+  // Depth pixels outside of the registered field of view can still project into it, so regions touching the border of the
+  // registered image extend to the border of the depth image
+  const int x0 = region.x == 0 ? 0 : std::max((int)std::floor(xL) - 1, 0);
+  const int y0 = region.y == 0 ? 0 : std::max((int)std::floor(yL) - 1, 0);
+  const int x1 = right == sizeRegistered.width - 1 ? sizeDepth.width : std::min((int)std::ceil(xH) + 2, sizeDepth.width);
+  const int y1 = bottom == sizeRegistered.height - 1 ? sizeDepth.height : std::min((int)std::ceil(yH) + 2, sizeDepth.height);
+  return cv::Rect(x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+}
+
+template<typename T>
+void DepthRegistrationCPU::clearRegistered(const Target<T> *targets, cv::Mat *registered, const size_t count) const
+{
+  for(size_t t = 0; t < count; ++t)
+  {
+    registered[t].create(targets[t].size, CV_16U);
+    registered[t].setTo(0);
+  }
+}
+
+template<typename T>
+void DepthRegistrationCPU::splatDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                                      const size_t count, const cv::Rect &region) const
+{
+  clearRegistered(targets, registered, count);
+
+  parallelFor(region.height, [&](const int i, const int)
+  {
+    splatRow(projection, targets, depth.ptr<uint16_t>(region.y + i), region.y + i, region, registered, count);
+  });
+}
+
+template<typename T>
+void DepthRegistrationCPU::splatRow(const Projection<T> &projection, const Target<T> *targets, const uint16_t *itD, const size_t r,
+                                    const cv::Rect &region, cv::Mat *registered, const size_t count) const
+{
+  const T near = zNear;
+  const T far = zFar;
+  const T *itX = &projection.rayX[r * sizeDepth.width];
+  const T *itY = &projection.rayY[r * sizeDepth.width];
+  const Eigen::Matrix<T, 3, 4, Eigen::DontAlign> &proj = projection.proj;
+
+  for(int c = region.x; c < region.x + region.width; ++c)
+  {
+    const T depthValue = itD[c] / (T)1000;
+
+    if(depthValue < near || depthValue > far)
+    {
+      continue;
+    }
+
+    const T x = itX[c] * depthValue;
+    const T y = itY[c] * depthValue;
+    const T pX = proj(0, 0) * x + proj(0, 1) * y + proj(0, 2) * depthValue + proj(0, 3);
+    const T pY = proj(1, 0) * x + proj(1, 1) * y + proj(1, 2) * depthValue + proj(1, 3);
+    const T pZ = proj(2, 0) * x + proj(2, 1) * y + proj(2, 2) * depthValue + proj(2, 3);
+
+    if(pZ <= 0)
+    {
+      continue;
+    }
+
+    const T invZ = 1 / pZ;
+    const uint16_t z16 = pZ * 1000;
+
+    for(size_t t = 0; t < count; ++t)
+    {
+      const Target<T> &target = targets[t];
+      const int width = target.size.width;
+      const int height = target.size.height;
+
+      // Continuous position in the registered image, where pixel i covers [i, i + 1)
+      const T u = (target.fx * pX) * invZ + target.cx;
+      const T v = (target.fy * pY) * invZ + target.cy;
+
+      // Fill all pixels whose centers are covered by the footprint of the depth pixel, but at least the one hit by its center
+      const T halfX = target.splatX * depthValue * invZ;
+      const T halfY = target.splatY * depthValue * invZ;
+      int xL = (int)std::ceil(u - halfX - (T)0.5);
+      int xH = (int)std::ceil(u + halfX - (T)0.5) - 1;
+      int yL = (int)std::ceil(v - halfY - (T)0.5);
+      int yH = (int)std::ceil(v + halfY - (T)0.5) - 1;
+      if(xH < xL)
+      {
+        xL = xH = (int)std::floor(u);
+      }
+      if(yH < yL)
+      {
+        yL = yH = (int)std::floor(v);
+      }
+      xL = std::max(xL - target.offsetX, 0);
+      yL = std::max(yL - target.offsetY, 0);
+      xH = std::min(xH - target.offsetX, width - 1);
+      yH = std::min(yH - target.offsetY, height - 1);
+
+      uint16_t *itR = registered[t].ptr<uint16_t>();
+      for(int yP = yL; yP <= yH; ++yP)
+      {
+        uint16_t *itP = itR + yP * width;
+        for(int xP = xL; xP <= xH; ++xP)
         {
-          zReg = z16;
+          updateDepth(itP[xP], z16);
         }
       }
     }
   }
 }
 
-void DepthRegistrationCPU::registerDepth(const cv::Mat &depth, cv::Mat &registered)
+template<typename T>
+void DepthRegistrationCPU::createRays(Projection<T> &projection) const
 {
-  cv::Mat scaled;
-  remapDepth(depth, scaled);
-  projectDepth(scaled, registered);
+  std::vector<cv::Point2f> points, undistorted;
+  points.reserve(sizeDepth.height * sizeDepth.width);
+  for(int r = 0; r < sizeDepth.height; ++r)
+  {
+    for(int c = 0; c < sizeDepth.width; ++c)
+    {
+      points.push_back(cv::Point2f(c, r));
+    }
+  }
+
+  // Normalized and undistorted image coordinates, multiplied with the depth they give the 3D point in the depth camera frame
+  cv::undistortPoints(points, undistorted, cameraMatrixDepth, distortionDepth);
+
+  projection.rayX.resize(undistorted.size());
+  projection.rayY.resize(undistorted.size());
+  for(size_t i = 0; i < undistorted.size(); ++i)
+  {
+    projection.rayX[i] = undistorted[i].x;
+    projection.rayY[i] = undistorted[i].y;
+  }
 }
 
-void DepthRegistrationCPU::createLookup()
+template<typename T>
+void DepthRegistrationCPU::createLookup(Projection<T> &projection) const
 {
   const double fx = 1.0 / cameraMatrixRegistered.at<double>(0, 0);
   const double fy = 1.0 / cameraMatrixRegistered.at<double>(1, 1);
   const double cx = cameraMatrixRegistered.at<double>(0, 2);
   const double cy = cameraMatrixRegistered.at<double>(1, 2);
-  double *it;
 
-  lookupY = cv::Mat(1, sizeRegistered.height, CV_64F);
-  it = lookupY.ptr<double>();
-  for(size_t r = 0; r < (size_t)sizeRegistered.height; ++r, ++it)
+  projection.lookupY.resize(sizeRegistered.height);
+  for(size_t r = 0; r < (size_t)sizeRegistered.height; ++r)
   {
-    *it = (r - cy) * fy;
+    projection.lookupY[r] = (r - cy) * fy;
   }
 
-  lookupX = cv::Mat(1, sizeRegistered.width, CV_64F);
-  it = lookupX.ptr<double>();
-  for(size_t c = 0; c < (size_t)sizeRegistered.width; ++c, ++it)
+  projection.lookupX.resize(sizeRegistered.width);
+  for(size_t c = 0; c < (size_t)sizeRegistered.width; ++c)
   {
-    *it = (c - cx) * fx;
+    projection.lookupX[c] = (c - cx) * fx;
   }
 }
@@ -19,33 +19,164 @@
 #ifndef __DEPTH_REGISTRATION_CPU_H__
 #define __DEPTH_REGISTRATION_CPU_H__
 
+#include <vector>
+
 #include <Eigen/Geometry>
 
 #include <kinect2_registration/kinect2_registration.h>
 
 class DepthRegistrationCPU : public DepthRegistration
 {
+public:
+  enum Mode
+  {
+    TWO_PASS = 0,
+    FUSED,
+    SPARSE,
+    INCREMENTAL
+  };
+
+  // Implementations of the bilinear interpolation of a row, init selects the fastest one the CPU supports
+  enum RemapKernel
+  {
+    REMAP_SCALAR = 0,
+    REMAP_SSE41,
+    REMAP_AVX2
+  };
+
+  typedef void (*RemapRowFunc)(const cv::Mat &in, const float *itX, const float *itY, uint16_t *itO, const size_t width);
+
 private:
-  cv::Mat lookupX, lookupY;
-  Eigen::Matrix4d proj;
-  double fx, fy, cx, cy;
+  // Camera model of an image the depth is registered into
+  template<typename T>
+  struct Target
+  {
+    cv::Size size;
+    T fx, fy, cx, cy;
+    // Top left corner of the image in the camera model, only set for regions of interest
+    int offsetX, offsetY;
+    // Row and column step through the registered resolution, used by the dense modes
+    int step;
+    // Half size of a depth pixel in the target image, only used by the sparse mode
+    T splatX, splatY;
+  };
+
+  // Projection parameters for the given precision. Only the 3x4 affine part of the transformation is stored,
+  // the last row of the homogeneous matrix is constant. The first target is the registered image given to init.
+  template<typename T>
+  struct Projection
+  {
+    Eigen::Matrix<T, 3, 4, Eigen::DontAlign> proj;
+    std::vector<Target<T> > targets;
+    std::vector<T> lookupX, lookupY;
+    // Undistorted rays of the depth pixels, only used by the sparse mode
+    std::vector<T> rayX, rayY;
+  };
+
+  // Tile of the registered image, only used by the incremental mode
+  struct Tile
+  {
+    cv::Rect rect;
+    // Range of depth tiles the pixels of the tile are interpolated from
+    cv::Rect depthTiles;
+    // Bounding boxes of the pixels the tile was projected to in the last frame, one per target
+    std::vector<cv::Rect> footprints;
+    bool dirty;
+  };
+
+  Mode mode;
+  bool doublePrecision;
+  Projection<float> projFloat;
+  Projection<double> projDouble;
+  RemapRowFunc remapRow;
+
+  // Reused between calls, so that registering a frame does not allocate memory
+  cv::Mat scaled, bufferRow, bufferPoints, bufferIndex, bufferValues;
+
+  // State of the incremental mode: the depth image the scaled image was remapped from and the last registered images of all
+  // targets. They are only updated where the depth changed, which holds as long as the same targets are registered every frame.
+  cv::Mat referenceDepth;
+  std::vector<cv::Mat> bufferRegistered;
+  std::vector<Tile> tiles;
+  std::vector<uint8_t> dirtyDepthTiles;
+  // Tiles of each target image that are cleared and registered again
+  std::vector<std::vector<uint8_t> > clearedTiles;
+  std::vector<cv::Size> tilesTargets;
+  cv::Size tilesRegistered, tilesDepth;
+  size_t incrementalTargets;
+  bool incrementalValid;
 
 public:
-  DepthRegistrationCPU();
+  DepthRegistrationCPU(const Mode mode = TWO_PASS, const bool doublePrecision = false);
 
   ~DepthRegistrationCPU();
 
   bool init(const int deviceId);
 
+  // Returns NULL if the kernel is not supported by the compiler or the CPU
+  static RemapRowFunc remapKernel(const RemapKernel kernel);
+
+  using DepthRegistration::registerDepth;
   void registerDepth(const cv::Mat &depth, cv::Mat &registered);
+  void registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered);
+  void registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered);
+
+protected:
+  bool initTarget(const size_t index);
+  bool calibrationChanged();
 
 private:
-  void createLookup();
+  void allocateBuffers();
+  void initTiles();
+
+  template<typename T>
+  void initProjection(Projection<T> &projection) const;
+  template<typename T>
+  void initTarget(Target<T> &target, const cv::Mat &cameraMatrix, const cv::Size &size) const;
+  template<typename T>
+  void createLookup(Projection<T> &projection) const;
+  template<typename T>
+  void createRays(Projection<T> &projection) const;
+
+  static uint16_t interpolate(const cv::Mat &in, const float &x, const float &y);
+  static void remapRowScalar(const cv::Mat &in, const float *itX, const float *itY, uint16_t *itO, const size_t width);
+
+  template<typename T>
+  void registerIncremental(const Projection<T> &projection, const cv::Mat &depth, cv::Mat *registered, const size_t count);
+  template<typename T>
+  void resetIncremental(const Projection<T> &projection, const cv::Mat &depth, const size_t count);
+  bool updateReference(const cv::Mat &depth);
+  static cv::Rect tileRange(const cv::Rect &rect, const cv::Size &tiles);
+  static cv::Rect tileRect(const int index, const cv::Size &tiles, const cv::Size &size);
+
+  template<typename T>
+  void registerROI(const Projection<T> &projection, const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered);
+
+  // All following functions only process the given region of the registered image, or of the depth image for the sparse mode
+  cv::Rect depthRegion(const cv::Rect &region) const;
 
-  uint16_t interpolate(const cv::Mat &in, const float &x, const float &y) const;
+  template<typename T>
+  void registerDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                     const size_t count, const cv::Rect &region);
+  template<typename T>
+  void clearRegistered(const Target<T> *targets, cv::Mat *registered, const size_t count) const;
 
-  void remapDepth(const cv::Mat &depth, cv::Mat &scaled) const;
-  void projectDepth(const cv::Mat &scaled, cv::Mat &registered) const;
+  void remapDepth(const cv::Mat &depth, cv::Mat &scaled, const cv::Rect &region) const;
+  template<typename T>
+  void projectDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &scaled, cv::Mat *registered,
+                    const size_t count, const cv::Rect &region);
+  template<typename T>
+  void remapProjectDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                         const size_t count, const cv::Rect &region);
+  template<typename T>
+  void projectRow(const Projection<T> &projection, const Target<T> *targets, const uint16_t *itD, const size_t r, const cv::Rect &region,
+                  T *points, int *index, uint16_t *values, cv::Mat *registered, const size_t count, cv::Rect *footprints = NULL) const;
+  template<typename T>
+  void splatDepth(const Projection<T> &projection, const Target<T> *targets, const cv::Mat &depth, cv::Mat *registered,
+                  const size_t count, const cv::Rect &region) const;
+  template<typename T>
+  void splatRow(const Projection<T> &projection, const Target<T> *targets, const uint16_t *itD, const size_t r, const cv::Rect &region,
+                cv::Mat *registered, const size_t count) const;
 };
 
 #endif //__DEPTH_REGISTRATION_CPU_H__
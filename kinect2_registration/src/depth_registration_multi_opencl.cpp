@@ -0,0 +1,255 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <sstream>
+
+#include "depth_registration_multi_opencl.h"
+
+#define OUT_NAME(FUNCTION) "[DepthRegistrationMultiOpenCL::" FUNCTION "] "
+
+DepthRegistrationMultiOpenCL::DepthRegistrationMultiOpenCL(const bool atomic)
+  : DepthRegistration(), atomic(atomic), asyncNext(0), asyncCount(0)
+{
+}
+
+DepthRegistrationMultiOpenCL::~DepthRegistrationMultiOpenCL()
+{
+  clearDevices();
+}
+
+void DepthRegistrationMultiOpenCL::clearDevices()
+{
+  for(size_t i = 0; i < devices.size(); ++i)
+  {
+    delete devices[i];
+  }
+  devices.clear();
+  idle.clear();
+}
+
+bool DepthRegistrationMultiOpenCL::init(const int deviceId)
+{
+  clearDevices();
+
+  if(deviceId != -1)
+  {
+    std::cout << OUT_NAME("init") "ignoring device " << deviceId << ", all devices are used." << std::endl;
+  }
+
+  const size_t count = DepthRegistrationOpenCL::getDeviceCount();
+  for(size_t i = 0; i < count; ++i)
+  {
+    DepthRegistrationOpenCL *device = new DepthRegistrationOpenCL(atomic);
+    device->setProfiling(profiling);
+    if(!device->DepthRegistration::init(cameraMatrixRegistered, sizeRegistered, cameraMatrixDepth, sizeDepth, distortionDepth,
+                                        rotation, translation, zNear, zFar, (int)i))
+    {
+      std::cerr << OUT_NAME("init") "could not initialize device " << i << ", skipping it." << std::endl;
+      delete device;
+      continue;
+    }
+    idle.push_back(devices.size());
+    devices.push_back(device);
+  }
+
+  if(devices.empty())
+  {
+    std::cerr << OUT_NAME("init") "no usable OpenCL device found." << std::endl;
+    return false;
+  }
+  std::cout << OUT_NAME("init") "registering on " << devices.size() << " devices." << std::endl;
+
+  deviceFillRadius.assign(devices.size(), 0);
+  deviceFillSigmaColor.assign(devices.size(), 0.0f);
+
+  std::lock_guard<std::mutex> guard(lock);
+  asyncNext = 0;
+  asyncCount = 0;
+  asyncActive.assign(devices.size(), 0);
+  return true;
+}
+
+// Blocks until a device is idle. The device that became idle last is used first, so a single caller always gets the same one.
+size_t DepthRegistrationMultiOpenCL::acquireDevice()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while(idle.empty())
+  {
+    idleChanged.wait(guard);
+  }
+
+  const size_t index = idle.back();
+  idle.pop_back();
+  return index;
+}
+
+// Blocks until the given device is idle
+void DepthRegistrationMultiOpenCL::acquireDevice(const size_t index)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  std::vector<size_t>::iterator it;
+  while((it = std::find(idle.begin(), idle.end(), index)) == idle.end())
+  {
+    idleChanged.wait(guard);
+  }
+  idle.erase(it);
+}
+
+void DepthRegistrationMultiOpenCL::releaseDevice(const size_t index)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    idle.push_back(index);
+  }
+  idleChanged.notify_one();
+}
+
+void DepthRegistrationMultiOpenCL::registerDepth(const cv::Mat &depth, cv::Mat &registered)
+{
+  const size_t index = acquireDevice();
+  devices[index]->registerDepth(depth, registered);
+  releaseDevice(index);
+}
+
+void DepthRegistrationMultiOpenCL::registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered)
+{
+  const size_t index = acquireDevice();
+  devices[index]->registerDepth(depth, registered);
+  releaseDevice(index);
+}
+
+void DepthRegistrationMultiOpenCL::registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered)
+{
+  const size_t index = acquireDevice();
+  if(deviceFillRadius[index] != fillRadius || deviceFillSigmaColor[index] != fillSigmaColor)
+  {
+    devices[index]->setHoleFilling(fillRadius, fillSigmaColor);
+    deviceFillRadius[index] = fillRadius;
+    deviceFillSigmaColor[index] = fillSigmaColor;
+  }
+  devices[index]->registerDepth(depth, color, registered);
+  releaseDevice(index);
+}
+
+void DepthRegistrationMultiOpenCL::registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered)
+{
+  const size_t index = acquireDevice();
+  devices[index]->registerDepth(depth, roi, registered);
+  releaseDevice(index);
+}
+
+bool DepthRegistrationMultiOpenCL::registerDepthAsync(const cv::Mat &depth, cv::Mat &registered)
+{
+  std::lock_guard<std::mutex> asyncGuard(asyncLock);
+
+  // Each device has at most one frame in flight, which is the oldest one once all devices got a frame
+  size_t index;
+  bool active;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(devices.empty())
+    {
+      return false;
+    }
+    index = asyncNext;
+    active = asyncActive[index] != 0;
+  }
+
+  // If the frame could not be started, the same device is tried again next time, so the frames stay in order
+  acquireDevice(index);
+  const bool started = devices[index]->startDepthAsync(depth);
+  const bool collected = started && active && devices[index]->collectPreviousAsync(registered);
+  releaseDevice(index);
+  if(!started)
+  {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  asyncNext = (index + 1) % devices.size();
+  if(!active)
+  {
+    asyncActive[index] = 1;
+    ++asyncCount;
+  }
+  return collected;
+}
+
+bool DepthRegistrationMultiOpenCL::finishDepthAsync(cv::Mat &registered)
+{
+  std::lock_guard<std::mutex> asyncGuard(asyncLock);
+
+  size_t oldest;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(!asyncCount)
+    {
+      return false;
+    }
+    oldest = (asyncNext + devices.size() - asyncCount) % devices.size();
+    --asyncCount;
+    asyncActive[oldest] = 0;
+  }
+
+  acquireDevice(oldest);
+  const bool ok = devices[oldest]->finishDepthAsync(registered);
+  releaseDevice(oldest);
+  return ok;
+}
+
+void DepthRegistrationMultiOpenCL::getProfile(std::vector<ProfileStage> &stages, const bool reset)
+{
+  stages.clear();
+  for(size_t i = 0; i < devices.size(); ++i)
+  {
+    std::vector<ProfileStage> deviceStages;
+    devices[i]->getProfile(deviceStages, reset);
+
+    std::ostringstream oss;
+    oss << "device" << i << ' ';
+    for(size_t j = 0; j < deviceStages.size(); ++j)
+    {
+      deviceStages[j].name = oss.str() + deviceStages[j].name;
+      stages.push_back(deviceStages[j]);
+    }
+  }
+}
+
+bool DepthRegistrationMultiOpenCL::initTarget(const size_t index)
+{
+  for(size_t i = 0; i < devices.size(); ++i)
+  {
+    if(!devices[i]->addTarget(cameraMatrixTargets[index], sizeTargets[index]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DepthRegistrationMultiOpenCL::calibrationChanged()
+{
+  for(size_t i = 0; i < devices.size(); ++i)
+  {
+    if(!devices[i]->updateCalibration(cameraMatrixRegistered, cameraMatrixDepth, distortionDepth, rotation, translation))
+    {
+      return false;
+    }
+  }
+  return true;
+}
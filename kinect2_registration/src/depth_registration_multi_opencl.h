@@ -0,0 +1,85 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#ifndef __DEPTH_REGISTRATION_MULTI_OPENCL_H__
+#define __DEPTH_REGISTRATION_MULTI_OPENCL_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <kinect2_registration/kinect2_registration.h>
+
+#include "depth_registration_opencl.h"
+
+// Spreads the registration over all OpenCL devices. Concurrent calls of the synchronous methods take the next idle device from a
+// work queue, so unlike the other backends they can be called from several threads at once. The asynchronous registration
+// distributes the frames round robin, which delays the result by one frame per device. It only takes a device from the queue
+// while it enqueues or collects a frame, so synchronous calls wait for at most one registration. They can use a device with an
+// asynchronous frame in flight, whose in-order queue keeps both apart.
+class DepthRegistrationMultiOpenCL : public DepthRegistration
+{
+private:
+  const bool atomic;
+  std::vector<DepthRegistrationOpenCL *> devices;
+
+  // Indices of the devices not registering a frame at the moment
+  std::vector<size_t> idle;
+  std::mutex lock;
+  std::condition_variable idleChanged;
+
+  // Hole filling parameters last passed to each device
+  std::vector<int> deviceFillRadius;
+  std::vector<float> deviceFillSigmaColor;
+
+  // Device the next asynchronous frame is started on, number of started frames not returned yet and the devices they are on,
+  // guarded by lock. asyncLock serializes the asynchronous calls, so that the frames stay in order.
+  size_t asyncNext, asyncCount;
+  std::vector<uint8_t> asyncActive;
+  std::mutex asyncLock;
+
+public:
+  DepthRegistrationMultiOpenCL(const bool atomic = false);
+
+  ~DepthRegistrationMultiOpenCL();
+
+  bool init(const int deviceId);
+
+  void registerDepth(const cv::Mat &depth, cv::Mat &registered);
+  void registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered);
+  void registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered);
+  void registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered);
+  using DepthRegistration::registerDepth;
+
+  bool registerDepthAsync(const cv::Mat &depth, cv::Mat &registered);
+  bool finishDepthAsync(cv::Mat &registered);
+
+  void getProfile(std::vector<ProfileStage> &stages, const bool reset = false);
+
+protected:
+  bool initTarget(const size_t index);
+  bool calibrationChanged();
+
+private:
+  void clearDevices();
+  size_t acquireDevice();
+  void acquireDevice(const size_t index);
+  void releaseDevice(const size_t index);
+};
+
+#endif //__DEPTH_REGISTRATION_MULTI_OPENCL_H__
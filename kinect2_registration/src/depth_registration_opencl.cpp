@@ -15,7 +15,19 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define __CL_ENABLE_EXCEPTIONS
 #ifdef __APPLE__
@@ -32,18 +44,65 @@
 
 #define OUT_NAME(FUNCTION) "[DepthRegistrationOpenCL::" FUNCTION "] "
 
+// OpenCL objects shared by all registrations using the same device in this process. Each registration keeps its own buffers,
+// kernels and queues, the context and the programs built in it exist only once.
+struct DeviceShared
+{
+  // Program and the number of registrations using it, it is removed together with its work group sizes when the last one
+  // releases it, e.g. after rebuilding it for a new calibration
+  struct Program
+  {
+    cl::Program program;
+    size_t users;
+  };
+
+  cl::Context context;
+  std::map<std::string, Program> programs;
+  // Work group sizes found by tuneWorkGroups, keyed like the programs plus the kernel variant
+  std::map<std::string, std::pair<size_t, size_t> > workGroups;
+  std::mutex lock;
+};
+
+static std::shared_ptr<DeviceShared> getDeviceShared(const cl::Device &device)
+{
+  static std::mutex lock;
+  static std::map<cl_device_id, std::weak_ptr<DeviceShared> > devices;
+
+  std::lock_guard<std::mutex> guard(lock);
+  std::shared_ptr<DeviceShared> shared = devices[device()].lock();
+  if(!shared)
+  {
+    shared = std::make_shared<DeviceShared>();
+    shared->context = cl::Context(device);
+    devices[device()] = shared;
+  }
+  return shared;
+}
+
 struct DepthRegistrationOpenCL::OCLData
 {
+  std::shared_ptr<DeviceShared> shared;
   cl::Context context;
   cl::Device device;
 
   cl::Program program;
+  // Options the program was built with and the key of it in the shared programs, empty if none is held
+  std::string programOptions;
+  // Cache file of the program binary, the tuned work group sizes are stored next to it. Empty if there is no cache directory.
+  std::string cacheFile;
   cl::CommandQueue queue;
+  // Separate in-order queues for the transfers of the asynchronous registration, so that they overlap with the kernels
+  cl::CommandQueue queueUpload;
+  cl::CommandQueue queueDownload;
 
   cl::Kernel kernelSetZero;
   cl::Kernel kernelProject;
   cl::Kernel kernelCheckDepth;
+  cl::Kernel kernelSetZeroAtomic;
+  cl::Kernel kernelProjectAtomic;
+  cl::Kernel kernelResolve;
   cl::Kernel kernelRemap;
+  cl::Kernel kernelFillHoles;
 
   size_t sizeDepth;
   size_t sizeRegistered;
@@ -51,7 +110,9 @@ struct DepthRegistrationOpenCL::OCLData
   size_t sizeImgZ;
   size_t sizeDists;
   size_t sizeSelDist;
+  size_t sizeZBuffer;
   size_t sizeMap;
+  size_t sizeColor;
 
   cl::Buffer bufferDepth;
   cl::Buffer bufferScaled;
@@ -60,21 +121,86 @@ struct DepthRegistrationOpenCL::OCLData
   cl::Buffer bufferImgZ;
   cl::Buffer bufferDists;
   cl::Buffer bufferSelDist;
+  cl::Buffer bufferZBuffer;
   cl::Buffer bufferMapX;
   cl::Buffer bufferMapY;
+  cl::Buffer bufferParams;
+
+  // Depth image as image object for remapDepthImage, filled from the depth buffer on the device
+  bool useImage;
+  cl::Image2D imageDepth;
+
+  // Local work size of the 2D kernel launches, 0 lets the driver choose
+  size_t localX, localY;
+
+  // Commands of the current registration and the stage they are recorded as, if profiling is enabled
+  std::vector<std::pair<std::string, cl::Event> > profileEvents;
+
+  // Hole filling, the weights are uploaded whenever the parameters changed
+  int fillRadius;
+  float fillSigmaColor;
+  cl::Buffer bufferColor;
+  cl::Buffer bufferFilled;
+  cl::Buffer bufferFillSpatial;
+  cl::Buffer bufferFillRange;
+
+  // Host memory shared with the device, only allocated if requested by getHostBuffers. With unified memory the kernels access
+  // it directly, otherwise it is pinned memory the transfers are done from.
+  bool hostBuffers;
+  bool unifiedMemory;
+  cl::Buffer bufferDepthHost;
+  cl::Buffer bufferRegisteredHost;
+  cv::Mat depthHost, registeredHost;
+
+  // Double buffered input and output of the asynchronous registration, the intermediate buffers are shared, because all
+  // kernels run in the same in-order queue
+  struct Frame
+  {
+    cv::Mat depth, registered;
+    cl::Buffer bufferDepth;
+    cl::Buffer bufferRegistered;
+    cl::Event eventUpload, eventKernel, eventDownload;
+    std::vector<std::pair<std::string, cl::Event> > profileEvents;
+    bool pending;
+  };
+
+  Frame frames[2];
+  size_t frameIndex;
+  bool framesReady;
 };
 
-DepthRegistrationOpenCL::DepthRegistrationOpenCL()
-  : DepthRegistration()
+DepthRegistrationOpenCL::DepthRegistrationOpenCL(const bool atomic, const bool runtimeParams, const bool imageRemap)
+  : DepthRegistration(), atomic(atomic), runtimeParams(runtimeParams), imageRemap(imageRemap), deviceId(-1)
 {
   data = new OCLData;
+  data->fillRadius = 0;
+  data->fillSigmaColor = 0;
+  data->frames[0].pending = data->frames[1].pending = false;
+  data->frameIndex = 0;
+  data->framesReady = false;
+  data->hostBuffers = false;
+  data->unifiedMemory = false;
+  data->useImage = false;
+  data->localX = data->localY = 0;
 }
 
 DepthRegistrationOpenCL::~DepthRegistrationOpenCL()
 {
+  clearTargets();
+  releaseHostBuffers();
+  releaseProgram();
   delete data;
 }
 
+void DepthRegistrationOpenCL::clearTargets()
+{
+  for(size_t i = 0; i < targetRegistrations.size(); ++i)
+  {
+    delete targetRegistrations[i];
+  }
+  targetRegistrations.clear();
+}
+
 void getDevices(const std::vector<cl::Platform> &platforms, std::vector<cl::Device> &devices)
 {
   devices.clear();
@@ -153,8 +279,34 @@ bool selectDevice(std::vector<cl::Device> &devices, cl::Device &device, const in
   return selected;
 }
 
+size_t DepthRegistrationOpenCL::getDeviceCount()
+{
+  try
+  {
+    std::vector<cl::Platform> platforms;
+    if(cl::Platform::get(&platforms) != CL_SUCCESS)
+    {
+      return 0;
+    }
+
+    std::vector<cl::Device> devices;
+    getDevices(platforms, devices);
+    return devices.size();
+  }
+  catch(const cl::Error &err)
+  {
+    std::cerr << OUT_NAME("getDeviceCount") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return 0;
+  }
+}
+
 bool DepthRegistrationOpenCL::init(const int deviceId)
 {
+  this->deviceId = deviceId;
+  clearTargets();
+  releaseHostBuffers();
+  releaseProgram();
+
   std::string sourceCode;
   if(!readProgram(sourceCode))
   {
@@ -212,16 +364,30 @@ bool DepthRegistrationOpenCL::init(const int deviceId)
       return false;
     }
 
-    data->context = cl::Context(data->device);
+    cl_bool unifiedMemory = CL_FALSE;
+    data->device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &unifiedMemory);
+    data->unifiedMemory = unifiedMemory == CL_TRUE;
+
+    cl_bool imageSupport = CL_FALSE;
+    data->device.getInfo(CL_DEVICE_IMAGE_SUPPORT, &imageSupport);
+    data->useImage = imageRemap && imageSupport == CL_TRUE;
+    if(imageRemap && !data->useImage)
+    {
+      std::cerr << OUT_NAME("init") "device does not support images, remapping from buffer." << std::endl;
+    }
+
+    data->shared = getDeviceShared(data->device);
+    data->context = data->shared->context;
 
     std::string options;
     generateOptions(options);
 
-    cl::Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()));
-    data->program = cl::Program(data->context, source);
-    data->program.build(options.c_str());
+    buildProgram(sourceCode, options);
 
-    data->queue = cl::CommandQueue(data->context, data->device, 0, &err);
+    const cl_command_queue_properties properties = profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    data->queue = cl::CommandQueue(data->context, data->device, properties, &err);
+    data->queueUpload = cl::CommandQueue(data->context, data->device, properties, &err);
+    data->queueDownload = cl::CommandQueue(data->context, data->device, properties, &err);
 
     data->sizeDepth = sizeDepth.height * sizeDepth.width * sizeof(uint16_t);
     data->sizeRegistered = sizeRegistered.height * sizeRegistered.width * sizeof(uint16_t);
@@ -229,45 +395,107 @@ bool DepthRegistrationOpenCL::init(const int deviceId)
     data->sizeImgZ = sizeRegistered.height * sizeRegistered.width * sizeof(uint16_t);
     data->sizeDists = sizeRegistered.height * sizeRegistered.width * sizeof(cl_float4);
     data->sizeSelDist = sizeRegistered.height * sizeRegistered.width * sizeof(float);
+    data->sizeZBuffer = sizeRegistered.height * sizeRegistered.width * sizeof(cl_uint);
     data->sizeMap = sizeRegistered.height * sizeRegistered.width * sizeof(float);
+    data->sizeColor = sizeRegistered.height * sizeRegistered.width * 3 * sizeof(uint8_t);
 
     data->bufferDepth = cl::Buffer(data->context, CL_READ_ONLY_CACHE, data->sizeDepth, NULL, &err);
     data->bufferScaled = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeRegistered, NULL, &err);
     data->bufferRegistered = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeRegistered, NULL, &err);
-    data->bufferIndex = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeIndex, NULL, &err);
-    data->bufferImgZ = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeImgZ, NULL, &err);
-    data->bufferDists = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeDists, NULL, &err);
-    data->bufferSelDist = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeSelDist, NULL, &err);
     data->bufferMapX = cl::Buffer(data->context, CL_READ_ONLY_CACHE, data->sizeMap, NULL, &err);
     data->bufferMapY = cl::Buffer(data->context, CL_READ_ONLY_CACHE, data->sizeMap, NULL, &err);
+    data->bufferColor = cl::Buffer(data->context, CL_READ_ONLY_CACHE, data->sizeColor, NULL, &err);
+    data->bufferFilled = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeRegistered, NULL, &err);
+    if(runtimeParams)
+    {
+      data->bufferParams = cl::Buffer(data->context, CL_READ_ONLY_CACHE, 18 * sizeof(float), NULL, &err);
+    }
+
+    if(atomic)
+    {
+      // A single packed z-buffer replaces the index, depth and distance buffers
+      data->bufferZBuffer = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeZBuffer, NULL, &err);
+
+      data->kernelSetZeroAtomic = cl::Kernel(data->program, "setZeroAtomic", &err);
+      data->kernelSetZeroAtomic.setArg(0, data->bufferZBuffer);
+
+      data->kernelProjectAtomic = cl::Kernel(data->program, "projectAtomic", &err);
+      data->kernelProjectAtomic.setArg(0, data->bufferScaled);
+      data->kernelProjectAtomic.setArg(1, data->bufferZBuffer);
+      if(runtimeParams)
+      {
+        data->kernelProjectAtomic.setArg(2, data->bufferParams);
+      }
+
+      data->kernelResolve = cl::Kernel(data->program, "resolveDepth", &err);
+      data->kernelResolve.setArg(0, data->bufferZBuffer);
+      data->kernelResolve.setArg(1, data->bufferRegistered);
+    }
+    else
+    {
+      data->bufferIndex = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeIndex, NULL, &err);
+      data->bufferImgZ = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeImgZ, NULL, &err);
+      data->bufferDists = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeDists, NULL, &err);
+      data->bufferSelDist = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeSelDist, NULL, &err);
+
+      data->kernelSetZero = cl::Kernel(data->program, "setZero", &err);
+      data->kernelSetZero.setArg(0, data->bufferRegistered);
+      data->kernelSetZero.setArg(1, data->bufferSelDist);
+
+      data->kernelProject = cl::Kernel(data->program, "project", &err);
+      data->kernelProject.setArg(0, data->bufferScaled);
+      data->kernelProject.setArg(1, data->bufferIndex);
+      data->kernelProject.setArg(2, data->bufferImgZ);
+      data->kernelProject.setArg(3, data->bufferDists);
+      data->kernelProject.setArg(4, data->bufferSelDist);
+      data->kernelProject.setArg(5, data->bufferRegistered);
+      if(runtimeParams)
+      {
+        data->kernelProject.setArg(6, data->bufferParams);
+      }
+
+      data->kernelCheckDepth = cl::Kernel(data->program, "checkDepth", &err);
+      data->kernelCheckDepth.setArg(0, data->bufferIndex);
+      data->kernelCheckDepth.setArg(1, data->bufferImgZ);
+      data->kernelCheckDepth.setArg(2, data->bufferDists);
+      data->kernelCheckDepth.setArg(3, data->bufferSelDist);
+      data->kernelCheckDepth.setArg(4, data->bufferRegistered);
+    }
+
+    if(data->useImage)
+    {
+      data->imageDepth = cl::Image2D(data->context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNSIGNED_INT16), sizeDepth.width, sizeDepth.height, 0, NULL, &err);
 
-    data->kernelSetZero = cl::Kernel(data->program, "setZero", &err);
-    data->kernelSetZero.setArg(0, data->bufferRegistered);
-    data->kernelSetZero.setArg(1, data->bufferSelDist);
-
-    data->kernelProject = cl::Kernel(data->program, "project", &err);
-    data->kernelProject.setArg(0, data->bufferScaled);
-    data->kernelProject.setArg(1, data->bufferIndex);
-    data->kernelProject.setArg(2, data->bufferImgZ);
-    data->kernelProject.setArg(3, data->bufferDists);
-    data->kernelProject.setArg(4, data->bufferSelDist);
-    data->kernelProject.setArg(5, data->bufferRegistered);
-
-    data->kernelCheckDepth = cl::Kernel(data->program, "checkDepth", &err);
-    data->kernelCheckDepth.setArg(0, data->bufferIndex);
-    data->kernelCheckDepth.setArg(1, data->bufferImgZ);
-    data->kernelCheckDepth.setArg(2, data->bufferDists);
-    data->kernelCheckDepth.setArg(3, data->bufferSelDist);
-    data->kernelCheckDepth.setArg(4, data->bufferRegistered);
-
-    data->kernelRemap = cl::Kernel(data->program, "remapDepth", &err);
-    data->kernelRemap.setArg(0, data->bufferDepth);
+      data->kernelRemap = cl::Kernel(data->program, "remapDepthImage", &err);
+      data->kernelRemap.setArg(0, data->imageDepth);
+    }
+    else
+    {
+      data->kernelRemap = cl::Kernel(data->program, "remapDepth", &err);
+      data->kernelRemap.setArg(0, data->bufferDepth);
+    }
     data->kernelRemap.setArg(1, data->bufferScaled);
     data->kernelRemap.setArg(2, data->bufferMapX);
     data->kernelRemap.setArg(3, data->bufferMapY);
 
+    data->kernelFillHoles = cl::Kernel(data->program, "fillHoles", &err);
+    data->kernelFillHoles.setArg(0, data->bufferRegistered);
+    data->kernelFillHoles.setArg(1, data->bufferColor);
+    data->kernelFillHoles.setArg(4, data->bufferFilled);
+    data->fillRadius = 0;
+
+    data->frames[0].pending = data->frames[1].pending = false;
+    data->frameIndex = 0;
+    data->framesReady = false;
+
     data->queue.enqueueWriteBuffer(data->bufferMapX, CL_TRUE, 0, data->sizeMap, mapX.data);
     data->queue.enqueueWriteBuffer(data->bufferMapY, CL_TRUE, 0, data->sizeMap, mapY.data);
+    if(runtimeParams)
+    {
+      uploadParams();
+    }
+
+    tuneWorkGroups(options);
   }
   catch(cl::Error err)
   {
@@ -293,28 +521,90 @@ void DepthRegistrationOpenCL::registerDepth(const cv::Mat &depth, cv::Mat &regis
     registered = cv::Mat(sizeRegistered, CV_16U);
   }
 
+  // Images from getHostBuffers are used by the kernels directly on devices with unified memory, otherwise they are pinned memory
+  const bool zeroCopyIn = data->hostBuffers && data->unifiedMemory && depth.data == data->depthHost.data;
+  const bool zeroCopyOut = data->hostBuffers && data->unifiedMemory && registered.data == data->registeredHost.data;
+
   try
   {
-    cl::Event eventKernel, eventZero;
-    cl::NDRange range(sizeRegistered.height * sizeRegistered.width);
+    // The queue is in-order and the read is blocking, so depth is not used after this call returns
+    if(zeroCopyIn)
+    {
+      data->queue.enqueueUnmapMemObject(data->bufferDepthHost, data->depthHost.data);
+    }
+    else
+    {
+      data->queue.enqueueWriteBuffer(data->bufferDepth, CL_FALSE, 0, data->sizeDepth, depth.data, NULL, profileEvent("upload"));
+    }
+    if(zeroCopyOut)
+    {
+      data->queue.enqueueUnmapMemObject(data->bufferRegisteredHost, data->registeredHost.data);
+    }
 
-    data->queue.enqueueWriteBuffer(data->bufferDepth, CL_TRUE, 0, data->sizeDepth, depth.data);
-    data->queue.enqueueNDRangeKernel(data->kernelSetZero, cl::NullRange, range, cl::NullRange, NULL, &eventZero);
+    enqueueKernels(zeroCopyIn ? data->bufferDepthHost : data->bufferDepth, zeroCopyOut ? data->bufferRegisteredHost : data->bufferRegistered,
+                   NULL, NULL);
+
+    if(zeroCopyIn || zeroCopyOut)
+    {
+      mapHostBuffers(zeroCopyIn, zeroCopyOut);
+    }
+    if(!zeroCopyOut)
+    {
+      data->queue.enqueueReadBuffer(data->bufferRegistered, CL_TRUE, 0, data->sizeRegistered, registered.data, NULL, profileEvent("download"));
+    }
+    collectProfile(data->profileEvents);
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("registerDepth") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return;
+  }
+}
 
-    data->queue.enqueueNDRangeKernel(data->kernelRemap, cl::NullRange, range, cl::NullRange, NULL, &eventKernel);
-    eventKernel.wait();
-    eventZero.wait();
+void DepthRegistrationOpenCL::registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered)
+{
+  if(!checkROI(roi))
+  {
+    return;
+  }
 
-    data->queue.enqueueNDRangeKernel(data->kernelProject, cl::NullRange, range, cl::NullRange, NULL, &eventKernel);
-    eventKernel.wait();
+  if(registered.empty() || registered.rows != roi.height || registered.cols != roi.width || registered.type() != CV_16U)
+  {
+    registered = cv::Mat(roi.size(), CV_16U);
+  }
 
-    data->queue.enqueueNDRangeKernel(data->kernelCheckDepth, cl::NullRange, range, cl::NullRange, NULL, &eventKernel);
-    eventKernel.wait();
+  // Only the part of the depth image the source region is remapped from is uploaded, and the kernels only run on the source
+  // region and the region of interest. Points that project outside of the region of interest land in the full size device
+  // buffer and are not read back.
+  const cv::Rect source = sourceRegion(roi, 1);
+  const cv::Rect input = remapRegion(source);
 
-    data->queue.enqueueNDRangeKernel(data->kernelCheckDepth, cl::NullRange, range, cl::NullRange, NULL, &eventKernel);
-    eventKernel.wait();
+  try
+  {
+    cl::size_t<3> bufferOrigin, hostOrigin, size;
+    if(input.area())
+    {
+      bufferOrigin[0] = hostOrigin[0] = input.x * sizeof(uint16_t);
+      bufferOrigin[1] = hostOrigin[1] = input.y;
+      bufferOrigin[2] = hostOrigin[2] = 0;
+      size[0] = input.width * sizeof(uint16_t);
+      size[1] = input.height;
+      size[2] = 1;
+      data->queue.enqueueWriteBufferRect(data->bufferDepth, CL_FALSE, bufferOrigin, hostOrigin, size, sizeDepth.width * sizeof(uint16_t), 0,
+                                         depth.step, 0, depth.data, NULL, profileEvent("upload"));
+    }
+    enqueueKernels(data->bufferDepth, data->bufferRegistered, source, roi, NULL, NULL);
 
-    data->queue.enqueueReadBuffer(data->bufferRegistered, CL_TRUE, 0, data->sizeRegistered, registered.data);
+    bufferOrigin[0] = roi.x * sizeof(uint16_t);
+    bufferOrigin[1] = roi.y;
+    bufferOrigin[2] = 0;
+    hostOrigin[0] = hostOrigin[1] = hostOrigin[2] = 0;
+    size[0] = roi.width * sizeof(uint16_t);
+    size[1] = roi.height;
+    size[2] = 1;
+    data->queue.enqueueReadBufferRect(data->bufferRegistered, CL_TRUE, bufferOrigin, hostOrigin, size, sizeRegistered.width * sizeof(uint16_t), 0,
+                                      registered.step, 0, registered.data, NULL, profileEvent("download"));
+    collectProfile(data->profileEvents);
   }
   catch(cl::Error err)
   {
@@ -323,49 +613,948 @@ void DepthRegistrationOpenCL::registerDepth(const cv::Mat &depth, cv::Mat &regis
   }
 }
 
-void DepthRegistrationOpenCL::generateOptions(std::string &options) const
+void DepthRegistrationOpenCL::registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered)
 {
-  std::ostringstream oss;
-  oss.precision(16);
-  oss << std::scientific;
+  if(fillRadius <= 0)
+  {
+    registerDepth(depth, registered);
+    return;
+  }
 
-  // Rotation
-  oss << " -D r00=" << rotation.at<double>(0, 0) << "f";
-  oss << " -D r01=" << rotation.at<double>(0, 1) << "f";
-  oss << " -D r02=" << rotation.at<double>(0, 2) << "f";
-  oss << " -D r10=" << rotation.at<double>(1, 0) << "f";
-  oss << " -D r11=" << rotation.at<double>(1, 1) << "f";
-  oss << " -D r12=" << rotation.at<double>(1, 2) << "f";
-  oss << " -D r20=" << rotation.at<double>(2, 0) << "f";
-  oss << " -D r21=" << rotation.at<double>(2, 1) << "f";
-  oss << " -D r22=" << rotation.at<double>(2, 2) << "f";
-
-  // Translation
-  oss << " -D tx=" << translation.at<double>(0, 0) << "f";
-  oss << " -D ty=" << translation.at<double>(1, 0) << "f";
-  oss << " -D tz=" << translation.at<double>(2, 0) << "f";
-
-  // Camera parameter upscaled depth
-  oss << " -D fxR=" << cameraMatrixRegistered.at<double>(0, 0) << "f";
-  oss << " -D fyR=" << cameraMatrixRegistered.at<double>(1, 1) << "f";
-  oss << " -D cxR=" << cameraMatrixRegistered.at<double>(0, 2) << "f";
-  oss << " -D cyR=" << cameraMatrixRegistered.at<double>(1, 2) << "f";
-  oss << " -D fxRInv=" << (1.0 / cameraMatrixRegistered.at<double>(0, 0)) << "f";
-  oss << " -D fyRInv=" << (1.0 / cameraMatrixRegistered.at<double>(1, 1)) << "f";
+  if(color.type() != CV_8UC3 || color.rows != sizeRegistered.height || color.cols != sizeRegistered.width || !color.isContinuous())
+  {
+    std::cerr << OUT_NAME("registerDepth") "color image does not match the registered depth image." << std::endl;
+    registerDepth(depth, registered);
+    return;
+  }
 
-  // Clipping distances
-  oss << " -D zNear=" << (uint16_t)(zNear * 1000);
-  oss << " -D zFar=" << (uint16_t)(zFar * 1000);
+  if(registered.empty() || registered.rows != sizeRegistered.height || registered.cols != sizeRegistered.width || registered.type() != CV_16U)
+  {
+    registered = cv::Mat(sizeRegistered, CV_16U);
+  }
 
-  // Size registered image
-  oss << " -D heightR=" << sizeRegistered.height;
-  oss << " -D widthR=" << sizeRegistered.width;
+  try
+  {
+    cl::NDRange range(sizeRegistered.width, sizeRegistered.height);
 
-  // Size depth image
-  oss << " -D heightD=" << sizeDepth.height;
-  oss << " -D widthD=" << sizeDepth.width;
+    updateFillWeights();
+    data->queue.enqueueWriteBuffer(data->bufferColor, CL_FALSE, 0, data->sizeColor, color.data, NULL, profileEvent("uploadColor"));
+    data->queue.enqueueWriteBuffer(data->bufferDepth, CL_FALSE, 0, data->sizeDepth, depth.data, NULL, profileEvent("upload"));
+    enqueueKernels(data->bufferDepth, data->bufferRegistered, NULL, NULL);
 
-  options = oss.str();
+    data->queue.enqueueNDRangeKernel(data->kernelFillHoles, cl::NullRange, range, localRange(sizeRegistered), NULL, profileEvent("fillHoles"));
+
+    data->queue.enqueueReadBuffer(data->bufferFilled, CL_TRUE, 0, data->sizeRegistered, registered.data, NULL, profileEvent("download"));
+    collectProfile(data->profileEvents);
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("registerDepth") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return;
+  }
+}
+
+void DepthRegistrationOpenCL::getHostBuffers(cv::Mat &depth, cv::Mat &registered)
+{
+  if(!data->hostBuffers)
+  {
+    try
+    {
+      data->bufferDepthHost = cl::Buffer(data->context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, data->sizeDepth, NULL, NULL);
+      data->bufferRegisteredHost = cl::Buffer(data->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, data->sizeRegistered, NULL, NULL);
+      mapHostBuffers(true, true);
+      data->hostBuffers = true;
+      std::cout << OUT_NAME("getHostBuffers") "using " << (data->unifiedMemory ? "zero copy" : "pinned") << " host buffers." << std::endl;
+    }
+    catch(cl::Error err)
+    {
+      std::cerr << OUT_NAME("getHostBuffers") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+      DepthRegistration::getHostBuffers(depth, registered);
+      return;
+    }
+  }
+
+  depth = data->depthHost;
+  registered = data->registeredHost;
+}
+
+// Maps the host buffers, blocking until the device is done with them. The runtime usually returns the same address again.
+void DepthRegistrationOpenCL::mapHostBuffers(const bool depth, const bool registered)
+{
+  if(depth)
+  {
+    void *ptr = data->queue.enqueueMapBuffer(data->bufferDepthHost, CL_TRUE, CL_MAP_WRITE, 0, data->sizeDepth);
+    if(data->hostBuffers && ptr != data->depthHost.data)
+    {
+      std::cerr << OUT_NAME("mapHostBuffers") "host buffer moved, getHostBuffers has to be called again." << std::endl;
+    }
+    data->depthHost = cv::Mat(sizeDepth, CV_16U, ptr);
+  }
+  if(registered)
+  {
+    void *ptr = data->queue.enqueueMapBuffer(data->bufferRegisteredHost, CL_TRUE, CL_MAP_READ, 0, data->sizeRegistered);
+    if(data->hostBuffers && ptr != data->registeredHost.data)
+    {
+      std::cerr << OUT_NAME("mapHostBuffers") "host buffer moved, getHostBuffers has to be called again." << std::endl;
+    }
+    data->registeredHost = cv::Mat(sizeRegistered, CV_16U, ptr);
+  }
+}
+
+void DepthRegistrationOpenCL::releaseHostBuffers()
+{
+  if(!data->hostBuffers)
+  {
+    return;
+  }
+
+  try
+  {
+    data->queue.enqueueUnmapMemObject(data->bufferDepthHost, data->depthHost.data);
+    data->queue.enqueueUnmapMemObject(data->bufferRegisteredHost, data->registeredHost.data);
+    data->queue.finish();
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("releaseHostBuffers") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+  }
+
+  data->depthHost = cv::Mat();
+  data->registeredHost = cv::Mat();
+  data->bufferDepthHost = cl::Buffer();
+  data->bufferRegisteredHost = cl::Buffer();
+  data->hostBuffers = false;
+}
+
+bool DepthRegistrationOpenCL::registerDepthAsync(const cv::Mat &depth, cv::Mat &registered)
+{
+  return startDepthAsync(depth) && collectPreviousAsync(registered);
+}
+
+bool DepthRegistrationOpenCL::startDepthAsync(const cv::Mat &depth)
+{
+  try
+  {
+    initFrames();
+
+    OCLData::Frame &frame = data->frames[data->frameIndex];
+    std::vector<cl::Event> waitEvents(1);
+
+    // The copy decouples the upload from the lifetime of depth
+    depth.copyTo(frame.depth);
+    data->queueUpload.enqueueWriteBuffer(frame.bufferDepth, CL_FALSE, 0, data->sizeDepth, frame.depth.data, NULL, &frame.eventUpload);
+    recordEvent("upload", frame.eventUpload);
+
+    waitEvents[0] = frame.eventUpload;
+    enqueueKernels(frame.bufferDepth, frame.bufferRegistered, &waitEvents, &frame.eventKernel);
+
+    waitEvents[0] = frame.eventKernel;
+    data->queueDownload.enqueueReadBuffer(frame.bufferRegistered, CL_FALSE, 0, data->sizeRegistered, frame.registered.data, &waitEvents,
+                                          &frame.eventDownload);
+    recordEvent("download", frame.eventDownload);
+    frame.profileEvents.swap(data->profileEvents);
+    data->profileEvents.clear();
+
+    data->queueUpload.flush();
+    data->queue.flush();
+    data->queueDownload.flush();
+    frame.pending = true;
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("startDepthAsync") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return false;
+  }
+
+  data->frameIndex = 1 - data->frameIndex;
+  return true;
+}
+
+// While the device works on the new frame, the previous one is collected
+bool DepthRegistrationOpenCL::collectPreviousAsync(cv::Mat &registered)
+{
+  return collectFrame(data->frameIndex, registered);
+}
+
+bool DepthRegistrationOpenCL::finishDepthAsync(cv::Mat &registered)
+{
+  return collectFrame(1 - data->frameIndex, registered);
+}
+
+void DepthRegistrationOpenCL::initFrames()
+{
+  if(data->framesReady)
+  {
+    return;
+  }
+
+  for(size_t i = 0; i < 2; ++i)
+  {
+    OCLData::Frame &frame = data->frames[i];
+    frame.depth.create(sizeDepth, CV_16U);
+    frame.registered.create(sizeRegistered, CV_16U);
+    frame.bufferDepth = cl::Buffer(data->context, CL_READ_ONLY_CACHE, data->sizeDepth, NULL, NULL);
+    frame.bufferRegistered = cl::Buffer(data->context, CL_READ_WRITE_CACHE, data->sizeRegistered, NULL, NULL);
+    frame.pending = false;
+  }
+  data->frameIndex = 0;
+  data->framesReady = true;
+}
+
+bool DepthRegistrationOpenCL::collectFrame(const size_t index, cv::Mat &registered)
+{
+  OCLData::Frame &frame = data->frames[index];
+  if(!frame.pending)
+  {
+    return false;
+  }
+  frame.pending = false;
+
+  try
+  {
+    frame.eventDownload.wait();
+    collectProfile(frame.profileEvents);
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("collectFrame") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return false;
+  }
+
+  frame.registered.copyTo(registered);
+  return true;
+}
+
+// Enqueues all registration kernels into the in-order queue, so no host side waits are needed between them
+void DepthRegistrationOpenCL::enqueueKernels(const cl::Buffer &depth, const cl::Buffer &registered, const std::vector<cl::Event> *waitEvents,
+                                             cl::Event *event)
+{
+  const cv::Rect image(0, 0, sizeRegistered.width, sizeRegistered.height);
+  enqueueKernels(depth, registered, image, image, waitEvents, event);
+}
+
+// The depth image is remapped and projected in the source region, the registered image is cleared and written in the output
+// region. The kernels use the global offset to index the full size buffers, so the regions can be anywhere in the image.
+void DepthRegistrationOpenCL::enqueueKernels(const cl::Buffer &depth, const cl::Buffer &registered, const cv::Rect &source, const cv::Rect &output,
+                                             const std::vector<cl::Event> *waitEvents, cl::Event *event)
+{
+  const cl::NDRange offsetSource(source.x, source.y);
+  const cl::NDRange rangeSource(source.width, source.height);
+  const cl::NDRange localSource = localRange(source.size());
+  const cl::NDRange offsetOutput(output.x, output.y);
+  const cl::NDRange rangeOutput(output.width, output.height);
+  const cl::NDRange localOutput = localRange(output.size());
+  const bool project = source.area() > 0;
+
+  if(data->useImage)
+  {
+    // The copy stays on the device, so all ways of getting the depth image into its buffer work the same with images. For a
+    // region of interest the parts of the buffer that were not uploaded are copied as well, but never read.
+    cl::size_t<3> origin, region;
+    origin[0] = origin[1] = origin[2] = 0;
+    region[0] = sizeDepth.width;
+    region[1] = sizeDepth.height;
+    region[2] = 1;
+    data->queue.enqueueCopyBufferToImage(depth, data->imageDepth, 0, origin, region, waitEvents, profileEvent("copyImage"));
+    waitEvents = NULL;
+  }
+  else
+  {
+    data->kernelRemap.setArg(0, depth);
+  }
+
+  if(atomic)
+  {
+    data->kernelResolve.setArg(1, registered);
+
+    data->queue.enqueueNDRangeKernel(data->kernelSetZeroAtomic, offsetOutput, rangeOutput, localOutput, waitEvents, profileEvent("setZeroAtomic"));
+    if(project)
+    {
+      data->queue.enqueueNDRangeKernel(data->kernelRemap, offsetSource, rangeSource, localSource, NULL, profileEvent("remapDepth"));
+      data->queue.enqueueNDRangeKernel(data->kernelProjectAtomic, offsetSource, rangeSource, localSource, NULL, profileEvent("projectAtomic"));
+    }
+    data->queue.enqueueNDRangeKernel(data->kernelResolve, offsetOutput, rangeOutput, localOutput, NULL, event ? event : profileEvent("resolveDepth"));
+    if(event)
+    {
+      recordEvent("resolveDepth", *event);
+    }
+    return;
+  }
+
+  data->kernelSetZero.setArg(0, registered);
+  data->kernelProject.setArg(5, registered);
+  data->kernelCheckDepth.setArg(4, registered);
+
+  // Events are only requested for the full image, whose source region is never empty
+  data->queue.enqueueNDRangeKernel(data->kernelSetZero, offsetOutput, rangeOutput, localOutput, waitEvents, profileEvent("setZero"));
+  if(!project)
+  {
+    return;
+  }
+  data->queue.enqueueNDRangeKernel(data->kernelRemap, offsetSource, rangeSource, localSource, NULL, profileEvent("remapDepth"));
+  data->queue.enqueueNDRangeKernel(data->kernelProject, offsetSource, rangeSource, localSource, NULL, profileEvent("project"));
+  data->queue.enqueueNDRangeKernel(data->kernelCheckDepth, offsetSource, rangeSource, localSource, NULL, profileEvent("checkDepth1"));
+  data->queue.enqueueNDRangeKernel(data->kernelCheckDepth, offsetSource, rangeSource, localSource, NULL, event ? event : profileEvent("checkDepth2"));
+  if(event)
+  {
+    recordEvent("checkDepth2", *event);
+  }
+}
+
+// Returns the event for the next command if profiling is enabled, otherwise NULL. The events are evaluated by collectProfile.
+cl::Event *DepthRegistrationOpenCL::profileEvent(const std::string &stage)
+{
+  if(!profiling)
+  {
+    return NULL;
+  }
+  data->profileEvents.push_back(std::make_pair(stage, cl::Event()));
+  return &data->profileEvents.back().second;
+}
+
+// Same as profileEvent for commands that already have an event
+void DepthRegistrationOpenCL::recordEvent(const std::string &stage, const cl::Event &event)
+{
+  if(profiling)
+  {
+    data->profileEvents.push_back(std::make_pair(stage, event));
+  }
+}
+
+// Adds the durations of finished commands to the profile and clears the events
+void DepthRegistrationOpenCL::collectProfile(std::vector<std::pair<std::string, cl::Event> > &events, const std::string &prefix)
+{
+  try
+  {
+    for(size_t i = 0; i < events.size(); ++i)
+    {
+      cl_ulong start = 0, end = 0;
+      events[i].second.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+      events[i].second.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+      addProfileSample(prefix + events[i].first, (end - start) / 1000000.0);
+    }
+  }
+  catch(cl::Error err)
+  {
+    // Commands that failed do not have profiling information
+  }
+  events.clear();
+}
+
+cl::NDRange DepthRegistrationOpenCL::localRange(const cv::Size &size) const
+{
+  // The global size has to be a multiple of the local size, which is not the case for all regions
+  if(!data->localX || size.width % data->localX || size.height % data->localY)
+  {
+    return cl::NullRange;
+  }
+  return cl::NDRange(data->localX, data->localY);
+}
+
+// Measures the whole registration for a set of work group sizes on a synthetic frame and keeps the fastest one. The result is
+// shared with all registrations using the same device, program and kernels, and stored next to the cached program binary for
+// later runs. The measurement only uses the kernels and buffers of this registration and runs without holding the lock of the
+// device, so that other registrations can build their programs meanwhile.
+void DepthRegistrationOpenCL::tuneWorkGroups(const std::string &options)
+{
+  std::ostringstream oss;
+  oss << options << (atomic ? " atomic" : "") << (data->useImage ? " image" : "");
+  const std::string key = oss.str();
+
+  {
+    std::lock_guard<std::mutex> guard(data->shared->lock);
+    std::map<std::string, std::pair<size_t, size_t> >::const_iterator it = data->shared->workGroups.find(key);
+    if(it != data->shared->workGroups.end())
+    {
+      data->localX = it->second.first;
+      data->localY = it->second.second;
+      return;
+    }
+  }
+
+  // The program cache file already identifies the device, driver, source and options, only the kernel variant is added
+  std::string cacheFile;
+  if(!data->cacheFile.empty())
+  {
+    cacheFile = data->cacheFile.substr(0, data->cacheFile.rfind('.')) + (atomic ? "_atomic" : "") + (data->useImage ? "_image" : "") +
+                ".workgroups";
+  }
+
+  // All kernels are launched with the same size, so it is limited by the most demanding one
+  std::vector<cl::Kernel> kernels;
+  kernels.push_back(data->kernelRemap);
+  kernels.push_back(data->kernelFillHoles);
+  if(atomic)
+  {
+    kernels.push_back(data->kernelSetZeroAtomic);
+    kernels.push_back(data->kernelProjectAtomic);
+    kernels.push_back(data->kernelResolve);
+  }
+  else
+  {
+    kernels.push_back(data->kernelSetZero);
+    kernels.push_back(data->kernelProject);
+    kernels.push_back(data->kernelCheckDepth);
+  }
+
+  size_t maxSize = 0;
+  data->device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxSize);
+  for(size_t i = 0; i < kernels.size(); ++i)
+  {
+    size_t kernelSize = 0;
+    kernels[i].getWorkGroupInfo(data->device, CL_KERNEL_WORK_GROUP_SIZE, &kernelSize);
+    maxSize = std::min(maxSize, kernelSize);
+  }
+
+  size_t cachedX = 0, cachedY = 0;
+  if(!cacheFile.empty() && loadWorkGroups(cacheFile, cachedX, cachedY) &&
+     (!cachedX || (cachedX * cachedY <= maxSize && !(sizeRegistered.width % cachedX) && !(sizeRegistered.height % cachedY))))
+  {
+    publishWorkGroups(key, cachedX, cachedY);
+    std::cout << OUT_NAME("tuneWorkGroups") "using cached work group size " << data->localX << "x" << data->localY << " for " << sizeRegistered.width
+              << "x" << sizeRegistered.height << "." << std::endl;
+    return;
+  }
+
+  // A plane in front of the camera, so that every pixel is remapped and projected
+  const cv::Mat depth(sizeDepth, CV_16U, cv::Scalar(1500));
+  data->queue.enqueueWriteBuffer(data->bufferDepth, CL_TRUE, 0, data->sizeDepth, depth.data);
+
+  // The first entry is the driver default
+  const size_t sizes[][2] = {{0, 0}, {8, 8}, {16, 4}, {16, 8}, {16, 16}, {32, 2}, {32, 4}, {32, 8}, {64, 1}, {64, 2}, {64, 4}, {128, 1}, {256, 1}};
+  const int runs = 5;
+  double bestTime = std::numeric_limits<double>::max();
+  size_t bestX = 0, bestY = 0;
+
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+  {
+    data->localX = sizes[i][0];
+    data->localY = sizes[i][1];
+    if(data->localX && (data->localX * data->localY > maxSize || sizeRegistered.width % data->localX || sizeRegistered.height % data->localY))
+    {
+      continue;
+    }
+
+    try
+    {
+      // The first run includes lazy allocations of the driver and is not measured
+      enqueueKernels(data->bufferDepth, data->bufferRegistered, NULL, NULL);
+      data->queue.finish();
+
+      const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+      for(int run = 0; run < runs; ++run)
+      {
+        enqueueKernels(data->bufferDepth, data->bufferRegistered, NULL, NULL);
+      }
+      data->queue.finish();
+      const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / runs;
+
+      if(elapsed < bestTime)
+      {
+        bestTime = elapsed;
+        bestX = data->localX;
+        bestY = data->localY;
+      }
+    }
+    catch(cl::Error err)
+    {
+      // Sizes the kernels can not be launched with are skipped
+      continue;
+    }
+  }
+
+  data->profileEvents.clear();
+  if(!publishWorkGroups(key, bestX, bestY))
+  {
+    std::cout << OUT_NAME("tuneWorkGroups") "using work group size " << data->localX << "x" << data->localY
+              << " tuned by another registration meanwhile." << std::endl;
+    return;
+  }
+  if(!cacheFile.empty())
+  {
+    saveWorkGroups(cacheFile, bestX, bestY);
+  }
+
+  if(bestX)
+  {
+    std::cout << OUT_NAME("tuneWorkGroups") "selected work group size " << bestX << "x" << bestY << " for " << sizeRegistered.width << "x"
+              << sizeRegistered.height << " (" << bestTime << " ms per frame)." << std::endl;
+  }
+  else
+  {
+    std::cout << OUT_NAME("tuneWorkGroups") "selected driver default work group size for " << sizeRegistered.width << "x"
+              << sizeRegistered.height << " (" << bestTime << " ms per frame)." << std::endl;
+  }
+}
+
+// Shares the work group size with the other registrations on the device and uses it. Returns false if another registration
+// published one for the same key first, which is used instead, so that all of them launch the kernels the same way.
+bool DepthRegistrationOpenCL::publishWorkGroups(const std::string &key, const size_t localX, const size_t localY)
+{
+  std::lock_guard<std::mutex> guard(data->shared->lock);
+  const std::pair<std::map<std::string, std::pair<size_t, size_t> >::iterator, bool> inserted =
+    data->shared->workGroups.insert(std::make_pair(key, std::make_pair(localX, localY)));
+  data->localX = inserted.first->second.first;
+  data->localY = inserted.first->second.second;
+  return inserted.second;
+}
+
+bool DepthRegistrationOpenCL::loadWorkGroups(const std::string &cacheFile, size_t &localX, size_t &localY) const
+{
+  std::ifstream file(cacheFile.c_str());
+  return file.is_open() && (file >> localX >> localY);
+}
+
+void DepthRegistrationOpenCL::saveWorkGroups(const std::string &cacheFile, const size_t localX, const size_t localY) const
+{
+  // Written to a temporary file first, like the program binary
+  std::ostringstream oss;
+  oss << cacheFile << '.' << getpid();
+  const std::string tmpFile = oss.str();
+
+  std::ofstream file(tmpFile.c_str());
+  if(!file.is_open())
+  {
+    return;
+  }
+  file << localX << ' ' << localY << std::endl;
+  file.close();
+
+  if(!file || std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+  {
+    std::remove(tmpFile.c_str());
+    std::cerr << OUT_NAME("saveWorkGroups") "could not write work group cache " << cacheFile << std::endl;
+  }
+}
+
+void DepthRegistrationOpenCL::updateFillWeights()
+{
+  if(data->fillRadius == fillRadius && data->fillSigmaColor == fillSigmaColor)
+  {
+    return;
+  }
+
+  const size_t sizeSpatial = fillSpatial.size() * sizeof(float);
+  const size_t sizeRange = fillRange.size() * sizeof(float);
+
+  data->bufferFillSpatial = cl::Buffer(data->context, CL_READ_ONLY_CACHE, sizeSpatial, NULL, NULL);
+  data->bufferFillRange = cl::Buffer(data->context, CL_READ_ONLY_CACHE, sizeRange, NULL, NULL);
+  data->queue.enqueueWriteBuffer(data->bufferFillSpatial, CL_TRUE, 0, sizeSpatial, &fillSpatial[0]);
+  data->queue.enqueueWriteBuffer(data->bufferFillRange, CL_TRUE, 0, sizeRange, &fillRange[0]);
+
+  data->kernelFillHoles.setArg(2, data->bufferFillSpatial);
+  data->kernelFillHoles.setArg(3, data->bufferFillRange);
+  data->kernelFillHoles.setArg(5, fillRadius);
+
+  data->fillRadius = fillRadius;
+  data->fillSigmaColor = fillSigmaColor;
+}
+
+void DepthRegistrationOpenCL::registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered)
+{
+  registered.resize(1 + targetRegistrations.size());
+  if(targetRegistrations.empty())
+  {
+    registerDepth(depth, registered[0]);
+    return;
+  }
+
+  for(size_t i = 0; i < registered.size(); ++i)
+  {
+    const cv::Size &size = i ? targetRegistrations[i - 1]->sizeRegistered : sizeRegistered;
+    if(registered[i].empty() || registered[i].rows != size.height || registered[i].cols != size.width || registered[i].type() != CV_16U)
+    {
+      registered[i] = cv::Mat(size, CV_16U);
+    }
+  }
+
+  const bool zeroCopyIn = data->hostBuffers && data->unifiedMemory && depth.data == data->depthHost.data;
+
+  try
+  {
+    // The targets share the queue and the context, so the depth image is uploaded once and used by all of them
+    if(zeroCopyIn)
+    {
+      data->queue.enqueueUnmapMemObject(data->bufferDepthHost, data->depthHost.data);
+    }
+    else
+    {
+      data->queue.enqueueWriteBuffer(data->bufferDepth, CL_FALSE, 0, data->sizeDepth, depth.data, NULL, profileEvent("upload"));
+    }
+    const cl::Buffer &bufferDepth = zeroCopyIn ? data->bufferDepthHost : data->bufferDepth;
+
+    enqueueKernels(bufferDepth, data->bufferRegistered, NULL, NULL);
+    data->queue.enqueueReadBuffer(data->bufferRegistered, CL_FALSE, 0, data->sizeRegistered, registered[0].data, NULL, profileEvent("download"));
+
+    for(size_t i = 0; i < targetRegistrations.size(); ++i)
+    {
+      DepthRegistrationOpenCL *target = targetRegistrations[i];
+      target->enqueueKernels(bufferDepth, target->data->bufferRegistered, NULL, NULL);
+      data->queue.enqueueReadBuffer(target->data->bufferRegistered, CL_FALSE, 0, target->data->sizeRegistered, registered[i + 1].data, NULL,
+                                    target->profileEvent("download"));
+    }
+
+    if(zeroCopyIn)
+    {
+      mapHostBuffers(true, false);
+    }
+    data->queue.finish();
+
+    // Stages of the targets are recorded in the profile of this registration
+    collectProfile(data->profileEvents);
+    for(size_t i = 0; i < targetRegistrations.size(); ++i)
+    {
+      std::ostringstream oss;
+      oss << "target" << i + 1 << ' ';
+      collectProfile(targetRegistrations[i]->data->profileEvents, oss.str());
+    }
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("registerDepth") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return;
+  }
+}
+
+bool DepthRegistrationOpenCL::initTarget(const size_t index)
+{
+  DepthRegistrationOpenCL *target = new DepthRegistrationOpenCL(atomic, runtimeParams, imageRemap);
+  target->setProfiling(profiling);
+  if(!target->DepthRegistration::init(cameraMatrixTargets[index], sizeTargets[index], cameraMatrixDepth, sizeDepth, distortionDepth,
+                                      rotation, translation, zNear, zFar, deviceId))
+  {
+    delete target;
+    return false;
+  }
+
+  // Kernels of the targets run in the queue of this registration, so that they can read the depth image uploaded by it
+  target->data->queue = data->queue;
+  target->data->queueUpload = data->queueUpload;
+  target->data->queueDownload = data->queueDownload;
+  targetRegistrations.push_back(target);
+  return true;
+}
+
+bool DepthRegistrationOpenCL::calibrationChanged()
+{
+  if(!runtimeParams)
+  {
+    // The camera model is compiled into the program, so it is built again and the targets are recreated
+    if(!init(deviceId))
+    {
+      return false;
+    }
+    for(size_t i = 0; i < sizeTargets.size(); ++i)
+    {
+      if(!initTarget(i))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  try
+  {
+    data->queue.enqueueWriteBuffer(data->bufferMapX, CL_TRUE, 0, data->sizeMap, mapX.data);
+    data->queue.enqueueWriteBuffer(data->bufferMapY, CL_TRUE, 0, data->sizeMap, mapY.data);
+    uploadParams();
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("calibrationChanged") "ERROR: " << err.what() << "(" << err.err() << ")" << std::endl;
+    return false;
+  }
+
+  for(size_t i = 0; i < targetRegistrations.size(); ++i)
+  {
+    if(!targetRegistrations[i]->updateCalibration(cameraMatrixTargets[i], cameraMatrixDepth, distortionDepth, rotation, translation))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void DepthRegistrationOpenCL::uploadParams()
+{
+  // Same order as the defines for PARAM_BUFFER in depth_registration.cl
+  float params[18];
+  for(int r = 0; r < 3; ++r)
+  {
+    for(int c = 0; c < 3; ++c)
+    {
+      params[r * 3 + c] = (float)rotation.at<double>(r, c);
+    }
+    params[9 + r] = (float)translation.at<double>(r, 0);
+  }
+  params[12] = (float)cameraMatrixRegistered.at<double>(0, 0);
+  params[13] = (float)cameraMatrixRegistered.at<double>(1, 1);
+  params[14] = (float)cameraMatrixRegistered.at<double>(0, 2);
+  params[15] = (float)cameraMatrixRegistered.at<double>(1, 2);
+  params[16] = (float)(1.0 / cameraMatrixRegistered.at<double>(0, 0));
+  params[17] = (float)(1.0 / cameraMatrixRegistered.at<double>(1, 1));
+
+  data->queue.enqueueWriteBuffer(data->bufferParams, CL_TRUE, 0, sizeof(params), params);
+}
+
+void DepthRegistrationOpenCL::generateOptions(std::string &options) const
+{
+  std::ostringstream oss;
+  oss.precision(16);
+  oss << std::scientific;
+
+  if(runtimeParams)
+  {
+    // Rotation, translation and camera parameters are read from a buffer, see uploadParams
+    oss << " -D PARAM_BUFFER";
+  }
+  else
+  {
+    // Rotation
+    oss << " -D r00=" << rotation.at<double>(0, 0) << "f";
+    oss << " -D r01=" << rotation.at<double>(0, 1) << "f";
+    oss << " -D r02=" << rotation.at<double>(0, 2) << "f";
+    oss << " -D r10=" << rotation.at<double>(1, 0) << "f";
+    oss << " -D r11=" << rotation.at<double>(1, 1) << "f";
+    oss << " -D r12=" << rotation.at<double>(1, 2) << "f";
+    oss << " -D r20=" << rotation.at<double>(2, 0) << "f";
+    oss << " -D r21=" << rotation.at<double>(2, 1) << "f";
+    oss << " -D r22=" << rotation.at<double>(2, 2) << "f";
+
+    // Translation
+    oss << " -D tx=" << translation.at<double>(0, 0) << "f";
+    oss << " -D ty=" << translation.at<double>(1, 0) << "f";
+    oss << " -D tz=" << translation.at<double>(2, 0) << "f";
+
+    // Camera parameter upscaled depth
+    oss << " -D fxR=" << cameraMatrixRegistered.at<double>(0, 0) << "f";
+    oss << " -D fyR=" << cameraMatrixRegistered.at<double>(1, 1) << "f";
+    oss << " -D cxR=" << cameraMatrixRegistered.at<double>(0, 2) << "f";
+    oss << " -D cyR=" << cameraMatrixRegistered.at<double>(1, 2) << "f";
+    oss << " -D fxRInv=" << (1.0 / cameraMatrixRegistered.at<double>(0, 0)) << "f";
+    oss << " -D fyRInv=" << (1.0 / cameraMatrixRegistered.at<double>(1, 1)) << "f";
+  }
+
+  // Clipping distances
+  oss << " -D zNear=" << (uint16_t)(zNear * 1000);
+  oss << " -D zFar=" << (uint16_t)(zFar * 1000);
+
+  // Size registered image
+  oss << " -D heightR=" << sizeRegistered.height;
+  oss << " -D widthR=" << sizeRegistered.width;
+
+  // Size depth image
+  oss << " -D heightD=" << sizeDepth.height;
+  oss << " -D widthD=" << sizeDepth.width;
+
+  options = oss.str();
+}
+
+// Builds the program from a cached binary if there is one for this device, driver, source and options, otherwise from source.
+// Registrations on the same device with the same options share the program, like the low resolution registration and the low
+// resolution target of the high resolution one in the bridge.
+void DepthRegistrationOpenCL::buildProgram(const std::string &sourceCode, const std::string &options)
+{
+  std::lock_guard<std::mutex> guard(data->shared->lock);
+  if(!getCacheFile(sourceCode, options, data->cacheFile))
+  {
+    data->cacheFile.clear();
+  }
+
+  std::map<std::string, DeviceShared::Program>::iterator it = data->shared->programs.find(options);
+  if(it != data->shared->programs.end())
+  {
+    data->program = it->second.program;
+    data->programOptions = options;
+    ++it->second.users;
+    std::cout << OUT_NAME("buildProgram") "using program shared with another registration." << std::endl;
+    return;
+  }
+
+  const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+  const std::string &cacheFile = data->cacheFile;
+
+  if(!cacheFile.empty() && loadProgram(cacheFile, options))
+  {
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << OUT_NAME("buildProgram") "loaded cached program binary in " << elapsed << " ms." << std::endl;
+  }
+  else
+  {
+    cl::Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()));
+    data->program = cl::Program(data->context, source);
+    data->program.build(options.c_str());
+
+    const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::cout << OUT_NAME("buildProgram") "compiled program in " << elapsed << " ms." << std::endl;
+
+    if(!cacheFile.empty())
+    {
+      saveProgram(cacheFile);
+    }
+  }
+
+  DeviceShared::Program &shared = data->shared->programs[options];
+  shared.program = data->program;
+  shared.users = 1;
+  data->programOptions = options;
+}
+
+void DepthRegistrationOpenCL::releaseProgram()
+{
+  if(!data->shared || data->programOptions.empty())
+  {
+    return;
+  }
+
+  const std::string &options = data->programOptions;
+  std::lock_guard<std::mutex> guard(data->shared->lock);
+  std::map<std::string, DeviceShared::Program>::iterator it = data->shared->programs.find(options);
+  if(it != data->shared->programs.end() && !--it->second.users)
+  {
+    data->shared->programs.erase(it);
+    data->shared->workGroups.erase(options);
+    data->shared->workGroups.erase(options + " atomic");
+    data->shared->workGroups.erase(options + " image");
+    data->shared->workGroups.erase(options + " atomic image");
+  }
+  data->programOptions.clear();
+  data->program = cl::Program();
+}
+
+// 64 bit FNV-1a, stable across platforms and runs unlike std::hash
+static uint64_t hashString(const std::string &str, uint64_t hash = 14695981039346656037ULL)
+{
+  for(size_t i = 0; i < str.size(); ++i)
+  {
+    hash ^= (uint8_t)str[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static bool createDirectory(const std::string &path)
+{
+  struct stat info;
+  if(stat(path.c_str(), &info) == 0)
+  {
+    return S_ISDIR(info.st_mode);
+  }
+  return mkdir(path.c_str(), 0755) == 0;
+}
+
+bool DepthRegistrationOpenCL::getCacheFile(const std::string &sourceCode, const std::string &options, std::string &cacheFile) const
+{
+  std::string path;
+  const char *cacheHome = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if(cacheHome && *cacheHome)
+  {
+    path = cacheHome;
+  }
+  else if(home && *home)
+  {
+    path = std::string(home) + "/.cache";
+    if(!createDirectory(path))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    return false;
+  }
+
+  path += "/kinect2_registration";
+  if(!createDirectory(path))
+  {
+    return false;
+  }
+
+  std::string devName, devVendor, devVersion, driverVersion;
+  data->device.getInfo(CL_DEVICE_NAME, &devName);
+  data->device.getInfo(CL_DEVICE_VENDOR, &devVendor);
+  data->device.getInfo(CL_DEVICE_VERSION, &devVersion);
+  data->device.getInfo(CL_DRIVER_VERSION, &driverVersion);
+
+  uint64_t hash = hashString(devName);
+  hash = hashString(devVendor, hash);
+  hash = hashString(devVersion, hash);
+  hash = hashString(driverVersion, hash);
+  hash = hashString(sourceCode, hash);
+  hash = hashString(options, hash);
+
+  std::ostringstream oss;
+  oss << path << "/program_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+  cacheFile = oss.str();
+  return true;
+}
+
+bool DepthRegistrationOpenCL::loadProgram(const std::string &cacheFile, const std::string &options)
+{
+  std::ifstream file(cacheFile.c_str(), std::ios::binary);
+  if(!file.is_open())
+  {
+    return false;
+  }
+
+  const std::string binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  file.close();
+  if(binary.empty())
+  {
+    return false;
+  }
+
+  try
+  {
+    std::vector<cl::Device> devices(1, data->device);
+    cl::Program::Binaries binaries(1, std::make_pair(binary.data(), binary.size()));
+    data->program = cl::Program(data->context, devices, binaries);
+    data->program.build(devices, options.c_str());
+  }
+  catch(cl::Error err)
+  {
+    std::cerr << OUT_NAME("loadProgram") "cached program binary is invalid, compiling from source." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void DepthRegistrationOpenCL::saveProgram(const std::string &cacheFile) const
+{
+  // The C++ bindings do not allocate the binary buffers, so the C API is used here
+  size_t size = 0;
+  if(clGetProgramInfo(data->program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL) != CL_SUCCESS || size == 0)
+  {
+    return;
+  }
+
+  std::vector<unsigned char> binary(size);
+  unsigned char *ptr = &binary[0];
+  if(clGetProgramInfo(data->program(), CL_PROGRAM_BINARIES, sizeof(unsigned char *), &ptr, NULL) != CL_SUCCESS)
+  {
+    return;
+  }
+
+  // Written to a temporary file first, so that concurrently starting processes never read a partial binary
+  std::ostringstream oss;
+  oss << cacheFile << '.' << getpid();
+  const std::string tmpFile = oss.str();
+
+  std::ofstream file(tmpFile.c_str(), std::ios::binary);
+  if(!file.is_open())
+  {
+    return;
+  }
+  file.write((const char *)&binary[0], binary.size());
+  file.close();
+
+  if(!file || std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+  {
+    std::remove(tmpFile.c_str());
+    std::cerr << OUT_NAME("saveProgram") "could not write program cache " << cacheFile << std::endl;
+  }
 }
 
 bool DepthRegistrationOpenCL::readProgram(std::string &source) const
@@ -21,6 +21,13 @@
 
 #include <kinect2_registration/kinect2_registration.h>
 
+namespace cl
+{
+class Buffer;
+class Event;
+class NDRange;
+}
+
 class DepthRegistrationOpenCL : public DepthRegistration
 {
 private:
@@ -28,19 +35,77 @@ private:
 
   OCLData *data;
 
+  // Resolve z-buffer conflicts with a packed atomic min instead of the project and check passes
+  const bool atomic;
+  // Pass the camera model to the kernels in a buffer instead of compiling it in, so that it can be updated without a rebuild
+  const bool runtimeParams;
+  // Read the depth image in the remap kernel from an image object, so that the neighborhood reads use the texture cache
+  const bool imageRemap;
+  int deviceId;
+  // One registration per added target, sharing the context, queue and depth upload of this one
+  std::vector<DepthRegistrationOpenCL *> targetRegistrations;
+
 public:
-  DepthRegistrationOpenCL();
+  DepthRegistrationOpenCL(const bool atomic = false, const bool runtimeParams = false, const bool imageRemap = false);
 
   ~DepthRegistrationOpenCL();
 
   bool init(const int deviceId);
 
   void registerDepth(const cv::Mat &depth, cv::Mat &registered);
+  void registerDepth(const cv::Mat &depth, std::vector<cv::Mat> &registered);
+  void registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered);
+  void registerDepth(const cv::Mat &depth, const cv::Rect &roi, cv::Mat &registered);
+  using DepthRegistration::registerDepth;
+
+  void getHostBuffers(cv::Mat &depth, cv::Mat &registered);
+
+  bool registerDepthAsync(const cv::Mat &depth, cv::Mat &registered);
+  bool finishDepthAsync(cv::Mat &registered);
+
+  // Both steps of registerDepthAsync: starts registering the depth image, which returns false if it could not be enqueued, and
+  // returns the registered image of the previous call if there is one
+  bool startDepthAsync(const cv::Mat &depth);
+  bool collectPreviousAsync(cv::Mat &registered);
+
+  // Number of OpenCL devices on all platforms, the valid device ids are 0 to count - 1
+  static size_t getDeviceCount();
+
+protected:
+  bool initTarget(const size_t index);
+  bool calibrationChanged();
 
 private:
+  void clearTargets();
+
+  void enqueueKernels(const cl::Buffer &depth, const cl::Buffer &registered, const std::vector<cl::Event> *waitEvents, cl::Event *event);
+  void enqueueKernels(const cl::Buffer &depth, const cl::Buffer &registered, const cv::Rect &source, const cv::Rect &output,
+                      const std::vector<cl::Event> *waitEvents, cl::Event *event);
+  void mapHostBuffers(const bool depth, const bool registered);
+  void releaseHostBuffers();
+  void initFrames();
+  bool collectFrame(const size_t index, cv::Mat &registered);
+  void updateFillWeights();
+  void tuneWorkGroups(const std::string &options);
+  bool publishWorkGroups(const std::string &key, const size_t localX, const size_t localY);
+  bool loadWorkGroups(const std::string &cacheFile, size_t &localX, size_t &localY) const;
+  void saveWorkGroups(const std::string &cacheFile, const size_t localX, const size_t localY) const;
+  cl::NDRange localRange(const cv::Size &size) const;
+  cl::Event *profileEvent(const std::string &stage);
+  void recordEvent(const std::string &stage, const cl::Event &event);
+  void collectProfile(std::vector<std::pair<std::string, cl::Event> > &events, const std::string &prefix = "");
+  void uploadParams();
+
   void generateOptions(std::string &options) const;
 
   bool readProgram(std::string &source) const;
+
+  void buildProgram(const std::string &sourceCode, const std::string &options);
+  // Drops the reference to the shared program, which is removed from the device if no other registration uses it
+  void releaseProgram();
+  bool getCacheFile(const std::string &sourceCode, const std::string &options, std::string &cacheFile) const;
+  bool loadProgram(const std::string &cacheFile, const std::string &options);
+  void saveProgram(const std::string &cacheFile) const;
 };
 
 #endif //__DEPTH_REGISTRATION_OPENCL_H__
@@ -0,0 +1,191 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <cstdlib>
+
+#include "depth_registration_reference.h"
+
+DepthRegistrationReference::DepthRegistrationReference()
+  : zNear(0.5), zFar(12.0)
+{
+}
+
+void DepthRegistrationReference::init(const cv::Mat &cameraMatrixRegistered, const cv::Size &sizeRegistered, const cv::Mat &cameraMatrixDepth,
+                                      const cv::Size &sizeDepth, const cv::Mat &distortionDepth, const cv::Mat &rotation, const cv::Mat &translation,
+                                      const double zNear, const double zFar)
+{
+  this->cameraMatrixRegistered = cameraMatrixRegistered;
+  this->cameraMatrixDepth = cameraMatrixDepth;
+  this->rotation = rotation;
+  this->translation = translation;
+  this->sizeRegistered = sizeRegistered;
+  this->sizeDepth = sizeDepth;
+  this->zNear = zNear;
+  this->zFar = zFar;
+
+  // k1, k2, p1, p2, k3, k4, k5, k6, missing coefficients are 0
+  const cv::Mat coefficients = distortionDepth.clone();
+  distortion.assign(8, 0.0);
+  for(size_t i = 0; i < coefficients.total() && i < distortion.size(); ++i)
+  {
+    distortion[i] = coefficients.ptr<double>()[i];
+  }
+
+  createMap();
+}
+
+// Same model as cv::initUndistortRectifyMap without a rectification: the ray of each registered pixel is distorted with the
+// depth camera model and projected into the depth image.
+void DepthRegistrationReference::createMap()
+{
+  const double fxR = cameraMatrixRegistered.at<double>(0, 0);
+  const double fyR = cameraMatrixRegistered.at<double>(1, 1);
+  const double cxR = cameraMatrixRegistered.at<double>(0, 2);
+  const double cyR = cameraMatrixRegistered.at<double>(1, 2);
+  const double fxD = cameraMatrixDepth.at<double>(0, 0);
+  const double fyD = cameraMatrixDepth.at<double>(1, 1);
+  const double cxD = cameraMatrixDepth.at<double>(0, 2);
+  const double cyD = cameraMatrixDepth.at<double>(1, 2);
+  const double k1 = distortion[0], k2 = distortion[1], p1 = distortion[2], p2 = distortion[3];
+  const double k3 = distortion[4], k4 = distortion[5], k5 = distortion[6], k6 = distortion[7];
+
+  mapX.resize(sizeRegistered.area());
+  mapY.resize(sizeRegistered.area());
+  for(int r = 0, i = 0; r < sizeRegistered.height; ++r)
+  {
+    for(int c = 0; c < sizeRegistered.width; ++c, ++i)
+    {
+      const double x = (c - cxR) / fxR;
+      const double y = (r - cyR) / fyR;
+      const double r2 = x * x + y * y;
+      const double radial = (1 + r2 * (k1 + r2 * (k2 + r2 * k3))) / (1 + r2 * (k4 + r2 * (k5 + r2 * k6)));
+      const double xD = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+      const double yD = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+
+      mapX[i] = fxD * xD + cxD;
+      mapY[i] = fyD * yD + cyD;
+    }
+  }
+}
+
+uint16_t DepthRegistrationReference::interpolate(const cv::Mat &depth, const double x, const double y)
+{
+  const int xL = (int)std::floor(x);
+  const int xH = (int)std::ceil(x);
+  const int yL = (int)std::floor(y);
+  const int yH = (int)std::ceil(y);
+
+  if(xL < 0 || yL < 0 || xH >= depth.cols || yH >= depth.rows)
+  {
+    return 0;
+  }
+
+  const int p[4] = {depth.at<uint16_t>(yL, xL), depth.at<uint16_t>(yL, xH), depth.at<uint16_t>(yH, xL), depth.at<uint16_t>(yH, xH)};
+  const double dX[4] = {x - xL, 1.0 - (x - xL), x - xL, 1.0 - (x - xL)};
+  const double dY[4] = {y - yL, y - yL, 1.0 - (y - yL), 1.0 - (y - yL)};
+
+  // At least 3 of the 4 neighbours have to be valid
+  int count = 0, sum = 0;
+  for(int i = 0; i < 4; ++i)
+  {
+    count += p[i] > 0;
+    sum += p[i];
+  }
+  if(count < 3)
+  {
+    return 0;
+  }
+
+  // And at least 3 of them have to be within 1% of their integer average
+  const int avg = sum / count;
+  const int thres = (int)(0.01 * avg);
+  bool valid[4];
+  count = 0;
+  for(int i = 0; i < 4; ++i)
+  {
+    valid[i] = std::abs(p[i] - avg) < thres;
+    count += valid[i];
+  }
+  if(count < 3)
+  {
+    return 0;
+  }
+
+  // Weighted by sqrt(2) minus the distance to the neighbour
+  double value = 0, weights = 0;
+  for(int i = 0; i < 4; ++i)
+  {
+    if(valid[i])
+    {
+      const double weight = std::sqrt(2.0) - std::sqrt(dX[i] * dX[i] + dY[i] * dY[i]);
+      value += p[i] * weight;
+      weights += weight;
+    }
+  }
+  return (uint16_t)(value / weights + 0.5);
+}
+
+void DepthRegistrationReference::registerDepth(const cv::Mat &depth, cv::Mat &registered) const
+{
+  const double fx = cameraMatrixRegistered.at<double>(0, 0);
+  const double fy = cameraMatrixRegistered.at<double>(1, 1);
+  const double cx = cameraMatrixRegistered.at<double>(0, 2);
+  const double cy = cameraMatrixRegistered.at<double>(1, 2);
+
+  registered = cv::Mat::zeros(sizeRegistered, CV_16U);
+
+  for(int r = 0, i = 0; r < sizeRegistered.height; ++r)
+  {
+    for(int c = 0; c < sizeRegistered.width; ++c, ++i)
+    {
+      const double z = interpolate(depth, mapX[i], mapY[i]) / 1000.0;
+      if(z < zNear || z > zFar)
+      {
+        continue;
+      }
+
+      // 3D point of the remapped pixel in the registered camera, before moving it by the extrinsic calibration
+      const double point[3] = {(c - cx) / fx * z, (r - cy) / fy * z, z};
+      double moved[3];
+      for(int j = 0; j < 3; ++j)
+      {
+        moved[j] = rotation.at<double>(j, 0) * point[0] + rotation.at<double>(j, 1) * point[1] + rotation.at<double>(j, 2) * point[2] +
+                   translation.at<double>(j, 0);
+      }
+      if(moved[2] <= 0)
+      {
+        continue;
+      }
+
+      // Pixel i covers [i, i + 1) around its center at i + 0.5
+      const double u = fx * moved[0] / moved[2] + cx + 0.5;
+      const double v = fy * moved[1] / moved[2] + cy + 0.5;
+      if(u < 0 || v < 0 || u >= sizeRegistered.width || v >= sizeRegistered.height)
+      {
+        continue;
+      }
+
+      uint16_t &zReg = registered.at<uint16_t>((int)v, (int)u);
+      const uint16_t z16 = (uint16_t)(moved[2] * 1000);
+      if(zReg == 0 || z16 < zReg)
+      {
+        zReg = z16;
+      }
+    }
+  }
+}
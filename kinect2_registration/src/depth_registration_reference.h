@@ -0,0 +1,56 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#ifndef __DEPTH_REGISTRATION_REFERENCE_H__
+#define __DEPTH_REGISTRATION_REFERENCE_H__
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Plain scalar double precision version of the original CPU registration, used by the benchmark and the tests to check the
+// results of the other methods. It does not derive from DepthRegistration and computes the undistortion map, the interpolation
+// and the projection itself from the calibration, without OpenCV maps, lookup tables, SIMD or threads. It deliberately follows
+// the same rules as the CPU registration, i.e. the validity of the interpolation, the pixels a point is written to and the
+// depth tolerance, so it can not find errors in these rules themselves. Not part of the library.
+class DepthRegistrationReference
+{
+private:
+  cv::Mat cameraMatrixRegistered, cameraMatrixDepth, rotation, translation;
+  std::vector<double> distortion;
+  cv::Size sizeRegistered, sizeDepth;
+  double zNear, zFar;
+
+  // Position in the depth image each pixel of the registered image is interpolated from
+  std::vector<double> mapX, mapY;
+
+public:
+  DepthRegistrationReference();
+
+  void init(const cv::Mat &cameraMatrixRegistered, const cv::Size &sizeRegistered, const cv::Mat &cameraMatrixDepth, const cv::Size &sizeDepth,
+            const cv::Mat &distortionDepth, const cv::Mat &rotation, const cv::Mat &translation,
+            const double zNear = 0.5, const double zFar = 12.0);
+
+  void registerDepth(const cv::Mat &depth, cv::Mat &registered) const;
+
+private:
+  void createMap();
+  static uint16_t interpolate(const cv::Mat &depth, const double x, const double y);
+};
+
+#endif //__DEPTH_REGISTRATION_REFERENCE_H__
@@ -15,6 +15,14 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include <kinect2_registration/kinect2_registration.h>
 
 #ifdef DEPTH_REG_CPU
@@ -23,11 +31,16 @@
 
 #ifdef DEPTH_REG_OPENCL
 #include "depth_registration_opencl.h"
+#include "depth_registration_multi_opencl.h"
 #endif
 
 #define OUT_NAME(FUNCTION) "[DepthRegistration::" FUNCTION "] "
 
+// Number of durations kept per profiled stage, about 10 seconds at 30 Hz
+#define PROFILE_WINDOW 300
+
 DepthRegistration::DepthRegistration()
+  : fillRadius(0), fillSigmaColor(10.0f), incrementalThreshold(0), asyncPending(false), profiling(false)
 {
 }
 
@@ -41,16 +54,541 @@ bool DepthRegistration::init(const cv::Mat &cameraMatrixRegistered, const cv::Si
 {
   this->cameraMatrixRegistered = cameraMatrixRegistered;
   this->cameraMatrixDepth = cameraMatrixDepth;
+  this->distortionDepth = distortionDepth;
   this->rotation = rotation;
   this->translation = translation;
   this->sizeRegistered = sizeRegistered;
   this->sizeDepth = sizeDepth;
   this->zNear = zNear;
   this->zFar = zFar;
+  cameraMatrixTargets.clear();
+  sizeTargets.clear();
+  asyncPending = false;
+
+  initMaps();
+  return init(deviceId);
+}
+
+bool DepthRegistration::updateCalibration(const cv::Mat &cameraMatrixRegistered, const cv::Mat &cameraMatrixDepth, const cv::Mat &distortionDepth,
+                                          const cv::Mat &rotation, const cv::Mat &translation)
+{
+  this->cameraMatrixRegistered = cameraMatrixRegistered;
+  this->cameraMatrixDepth = cameraMatrixDepth;
+  this->distortionDepth = distortionDepth;
+  this->rotation = rotation;
+  this->translation = translation;
+
+  initMaps();
+  if(!calibrationChanged())
+  {
+    std::cerr << OUT_NAME("updateCalibration") "could not update calibration." << std::endl;
+    return false;
+  }
+  return true;
+}
 
+void DepthRegistration::initMaps()
+{
   cv::initUndistortRectifyMap(cameraMatrixDepth, distortionDepth, cv::Mat(), cameraMatrixRegistered, sizeRegistered, CV_32FC1, mapX, mapY);
 
-  return init(deviceId);
+  const double fx = 1.0 / cameraMatrixRegistered.at<double>(0, 0);
+  const double fy = 1.0 / cameraMatrixRegistered.at<double>(1, 1);
+  const double cx = cameraMatrixRegistered.at<double>(0, 2);
+  const double cy = cameraMatrixRegistered.at<double>(1, 2);
+
+  cloudLookupY.resize(sizeRegistered.height);
+  for(size_t r = 0; r < (size_t)sizeRegistered.height; ++r)
+  {
+    cloudLookupY[r] = (r - cy) * fy;
+  }
+
+  cloudLookupX.resize(sizeRegistered.width);
+  for(size_t c = 0; c < (size_t)sizeRegistered.width; ++c)
+  {
+    cloudLookupX[c] = (c - cx) * fx;
+  }
+}
+
+void DepthRegistration::setScheduler(const std::shared_ptr<RegistrationScheduler> &scheduler)
+{
+  this->scheduler = scheduler;
+}
+
+void DepthRegistration::parallelFor(const int count, const LoopFunc loop, const void *body, const bool balance) const
+{
+  if(scheduler)
+  {
+    // Captures only two pointers, which std::function stores without allocating
+    scheduler->parallelFor(count, [loop, body](const int begin, const int end, const int thread)
+    {
+      for(int i = begin; i < end; ++i)
+      {
+        loop(body, i, thread);
+      }
+    });
+    return;
+  }
+
+#ifdef _OPENMP
+  if(balance)
+  {
+    #pragma omp parallel for schedule(dynamic)
+    for(int i = 0; i < count; ++i)
+    {
+      loop(body, i, omp_get_thread_num());
+    }
+    return;
+  }
+
+  #pragma omp parallel for
+  for(int i = 0; i < count; ++i)
+  {
+    loop(body, i, omp_get_thread_num());
+  }
+#else
+  for(int i = 0; i < count; ++i)
+  {
+    loop(body, i, 0);
+  }
+#endif
+}
+
+int DepthRegistration::threadCount() const
+{
+  if(scheduler)
+  {
+    return scheduler->threadCount();
+  }
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+void DepthRegistration::setProfiling(const bool enable)
+{
+  profiling = enable;
+}
+
+void DepthRegistration::addProfileSample(const std::string &stage, const double duration)
+{
+  std::lock_guard<std::mutex> guard(profileLock);
+
+  size_t index = 0;
+  while(index < profileWindows.size() && profileWindows[index].name != stage)
+  {
+    ++index;
+  }
+  if(index == profileWindows.size())
+  {
+    profileWindows.push_back(ProfileWindow());
+    profileWindows[index].name = stage;
+    profileWindows[index].samples.reserve(PROFILE_WINDOW);
+    profileWindows[index].next = 0;
+  }
+
+  ProfileWindow &window = profileWindows[index];
+  if(window.samples.size() < PROFILE_WINDOW)
+  {
+    window.samples.push_back(duration);
+  }
+  else
+  {
+    window.samples[window.next] = duration;
+    window.next = (window.next + 1) % PROFILE_WINDOW;
+  }
+}
+
+void DepthRegistration::getProfile(std::vector<ProfileStage> &stages, const bool reset)
+{
+  std::lock_guard<std::mutex> guard(profileLock);
+
+  stages.clear();
+  for(size_t i = 0; i < profileWindows.size(); ++i)
+  {
+    std::vector<double> sorted = profileWindows[i].samples;
+    if(sorted.empty())
+    {
+      continue;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    ProfileStage stage;
+    stage.name = profileWindows[i].name;
+    stage.count = sorted.size();
+    stage.mean = 0;
+    for(size_t j = 0; j < sorted.size(); ++j)
+    {
+      stage.mean += sorted[j];
+    }
+    stage.mean /= sorted.size();
+    stage.min = sorted.front();
+    stage.median = sorted[sorted.size() / 2];
+    stage.p90 = sorted[(sorted.size() * 90) / 100];
+    stage.p99 = sorted[(sorted.size() * 99) / 100];
+    stage.max = sorted.back();
+    stages.push_back(stage);
+  }
+
+  if(reset)
+  {
+    profileWindows.clear();
+  }
+}
+
+bool DepthRegistration::addTarget(const cv::Mat &cameraMatrix, const cv::Size &size)
+{
+  cameraMatrixTargets.push_back(cameraMatrix);
+  sizeTargets.push_back(size);
+
+  if(!initTarget(sizeTargets.size() - 1))
+  {
+    std::cerr << OUT_NAME("addTarget") "could not initialize target." << std::endl;
+    cameraMatrixTargets.pop_back();
+    sizeTargets.pop_back();
+    return false;
+  }
+  return true;
+}
+
+bool DepthRegistration::checkROI(const cv::Rect &roi) const
+{
+  if(roi.width <= 0 || roi.height <= 0 || roi.x < 0 || roi.y < 0 || roi.x + roi.width > sizeRegistered.width || roi.y + roi.height > sizeRegistered.height)
+  {
+    std::cerr << OUT_NAME("checkROI") "region of interest is not inside the registered image." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A point with the depth z in the depth camera, seen by a pixel of the registered image, lies on the plane z = const. For a fixed
+// z the mapping from the registered image to the undistorted depth image is therefore a homography, and along the ray of a
+// pixel the position in the undistorted image moves monotonically with z. So the corners of the region of interest at zNear and
+// zFar bound the region that projects into it. Points are assigned to the pixel their projection is truncated to.
+cv::Rect DepthRegistration::sourceRegion(const cv::Rect &roi, const double reach) const
+{
+  const cv::Rect image(0, 0, sizeRegistered.width, sizeRegistered.height);
+  const double fx = cameraMatrixRegistered.at<double>(0, 0);
+  const double fy = cameraMatrixRegistered.at<double>(1, 1);
+  const double cx = cameraMatrixRegistered.at<double>(0, 2);
+  const double cy = cameraMatrixRegistered.at<double>(1, 2);
+  const double cornersX[2] = {roi.x - reach, roi.x + roi.width + reach};
+  const double cornersY[2] = {roi.y - reach, roi.y + roi.height + reach};
+  const double depths[2] = {zNear, zFar};
+
+  // Rotation and translation from the registered camera back to the depth camera
+  double invRotation[3][3], invTranslation[3];
+  for(int r = 0; r < 3; ++r)
+  {
+    invTranslation[r] = 0;
+    for(int c = 0; c < 3; ++c)
+    {
+      invRotation[r][c] = rotation.at<double>(c, r);
+      invTranslation[r] -= rotation.at<double>(c, r) * translation.at<double>(c, 0);
+    }
+  }
+
+  double xL = sizeRegistered.width, xH = -1, yL = sizeRegistered.height, yH = -1;
+  for(int i = 0; i < 8; ++i)
+  {
+    const double ray[3] = {(cornersX[i & 1] - cx) / fx, (cornersY[(i >> 1) & 1] - cy) / fy, 1.0};
+    const double z = depths[i >> 2];
+    double rayDepth[3];
+    for(int r = 0; r < 3; ++r)
+    {
+      rayDepth[r] = invRotation[r][0] * ray[0] + invRotation[r][1] * ray[1] + invRotation[r][2] * ray[2];
+    }
+
+    // Distance along the ray at which the point has the depth z in the depth camera, if the ray reaches it at all
+    const double scale = (z - invTranslation[2]) / rayDepth[2];
+    if(rayDepth[2] <= 0 || scale <= 0)
+    {
+      return image;
+    }
+
+    const double x = fx * (scale * rayDepth[0] + invTranslation[0]) / z + cx;
+    const double y = fy * (scale * rayDepth[1] + invTranslation[1]) / z + cy;
+    xL = std::min(xL, x);
+    xH = std::max(xH, x);
+    yL = std::min(yL, y);
+    yH = std::max(yH, y);
+  }
+
+  // One more pixel on each side covers the rounding of the single precision backends
+  const int x0 = std::max((int)std::floor(xL) - 1, 0);
+  const int y0 = std::max((int)std::floor(yL) - 1, 0);
+  const int x1 = std::min((int)std::ceil(xH) + 2, sizeRegistered.width);
+  const int y1 = std::min((int)std::ceil(yH) + 2, sizeRegistered.height);
+  if(x1 <= x0 || y1 <= y0)
+  {
+    return cv::Rect();
+  }
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+cv::Rect DepthRegistration::remapRegion(const cv::Rect &region) const
+{
+  if(region.width == sizeRegistered.width && region.height == sizeRegistered.height)
+  {
+    return cv::Rect(0, 0, sizeDepth.width, sizeDepth.height);
+  }
+
+  // Same as for the sparse CPU registration, the undistortion is monotonic, so the border of the region is enough
+  float xL = sizeDepth.width, xH = -1, yL = sizeDepth.height, yH = -1;
+  const int right = region.x + region.width - 1;
+  const int bottom = region.y + region.height - 1;
+  for(int r = region.y; r <= bottom; ++r)
+  {
+    const int step = (r == region.y || r == bottom) ? 1 : region.width - 1;
+    for(int c = region.x; c <= right; c += std::max(step, 1))
+    {
+      const float x = mapX.at<float>(r, c);
+      const float y = mapY.at<float>(r, c);
+      xL = std::min(xL, x);
+      xH = std::max(xH, x);
+      yL = std::min(yL, y);
+      yH = std::max(yH, y);
+    }
+  }
+
+  // The interpolation reads the pixel the position is truncated to and its right and lower neighbours
+  const int x0 = std::max((int)std::floor(xL), 0);
+  const int y0 = std::max((int)std::floor(yL), 0);
+  const int x1 = std::min((int)std::floor(xH) + 2, sizeDepth.width);
+  const int y1 = std::min((int)std::floor(yH) + 2, sizeDepth.height);
+  if(x1 <= x0 || y1 <= y0)
+  {
+    return cv::Rect();
+  }
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+void DepthRegistration::getHostBuffers(cv::Mat &depth, cv::Mat &registered)
+{
+  hostDepth.create(sizeDepth, CV_16U);
+  hostRegistered.create(sizeRegistered, CV_16U);
+  depth = hostDepth;
+  registered = hostRegistered;
+}
+
+bool DepthRegistration::registerDepthAsync(const cv::Mat &depth, cv::Mat &registered)
+{
+  const bool pending = finishDepthAsync(registered);
+
+  // The previous result was copied out, so the buffer is reused and the registration keeps writing into the same image
+  registerDepth(depth, bufferAsync);
+  asyncPending = true;
+  return pending;
+}
+
+bool DepthRegistration::finishDepthAsync(cv::Mat &registered)
+{
+  if(!asyncPending)
+  {
+    return false;
+  }
+
+  bufferAsync.copyTo(registered);
+  asyncPending = false;
+  return true;
+}
+
+void DepthRegistration::setIncrementalThreshold(const int threshold)
+{
+  incrementalThreshold = std::max(threshold, 0);
+}
+
+void DepthRegistration::setHoleFilling(const int radius, const float sigmaColor)
+{
+  fillRadius = std::max(radius, 0);
+  fillSigmaColor = sigmaColor;
+
+  const int size = 2 * fillRadius + 1;
+  const float sigmaSpatial = std::max(fillRadius * 0.5f, 0.5f);
+  fillSpatial.resize(size * size);
+  for(int y = -fillRadius, i = 0; y <= fillRadius; ++y)
+  {
+    for(int x = -fillRadius; x <= fillRadius; ++x, ++i)
+    {
+      fillSpatial[i] = std::exp(-(x * x + y * y) / (2.0f * sigmaSpatial * sigmaSpatial));
+    }
+  }
+
+  // The difference is the sum over all three channels, the sigma is given per channel
+  fillRange.resize(3 * 255 + 1);
+  for(size_t i = 0; i < fillRange.size(); ++i)
+  {
+    const float diff = i / 3.0f;
+    fillRange[i] = std::exp(-(diff * diff) / (2.0f * sigmaColor * sigmaColor));
+  }
+}
+
+void DepthRegistration::registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered)
+{
+  registerDepth(depth, registered);
+
+  if(fillRadius > 0)
+  {
+    fillHoles(color, registered);
+  }
+}
+
+void DepthRegistration::fillHoles(const cv::Mat &color, cv::Mat &registered)
+{
+  if(color.type() != CV_8UC3 || color.rows != registered.rows || color.cols != registered.cols)
+  {
+    std::cerr << OUT_NAME("fillHoles") "color image does not match the registered depth image." << std::endl;
+    return;
+  }
+
+  // Holes are only filled from valid pixels of the input, so the result does not depend on the processing order
+  registered.copyTo(bufferFill);
+
+  // Integral image of the valid pixels, used to skip holes without any valid neighbour at constant cost
+  bufferCount.create(registered.rows + 1, registered.cols + 1, CV_32S);
+  bufferCount.row(0).setTo(0);
+
+  parallelFor(registered.rows, [&](const int r, const int)
+  {
+    const uint16_t *itI = bufferFill.ptr<uint16_t>(r);
+    int *itC = bufferCount.ptr<int>(r + 1);
+    int sum = 0;
+
+    *itC++ = 0;
+    for(int c = 0; c < registered.cols; ++c)
+    {
+      sum += itI[c] != 0;
+      itC[c] = sum;
+    }
+  });
+
+  for(int r = 1; r < registered.rows; ++r)
+  {
+    const int *itP = bufferCount.ptr<int>(r);
+    int *itC = bufferCount.ptr<int>(r + 1);
+
+    for(int c = 0; c <= registered.cols; ++c)
+    {
+      itC[c] += itP[c];
+    }
+  }
+
+  const int radius = fillRadius;
+  const int size = 2 * radius + 1;
+
+  parallelFor(registered.rows, [&](const int r, const int)
+  {
+    const uint16_t *itI = bufferFill.ptr<uint16_t>(r);
+    const cv::Vec3b *itC = color.ptr<cv::Vec3b>(r);
+    uint16_t *itO = registered.ptr<uint16_t>(r);
+
+    const int yL = std::max(r - radius, 0);
+    const int yH = std::min(r + radius, registered.rows - 1);
+    const int *itCountL = bufferCount.ptr<int>(yL);
+    const int *itCountH = bufferCount.ptr<int>(yH + 1);
+
+    for(int c = 0; c < registered.cols; ++c)
+    {
+      if(itI[c])
+      {
+        continue;
+      }
+
+      const int xL = std::max(c - radius, 0);
+      const int xH = std::min(c + radius, registered.cols - 1);
+      if(itCountH[xH + 1] - itCountH[xL] - itCountL[xH + 1] + itCountL[xL] == 0)
+      {
+        continue;
+      }
+
+      const cv::Vec3b &center = itC[c];
+      float sumDepth = 0, sumWeight = 0;
+
+      for(int y = yL; y <= yH; ++y)
+      {
+        const uint16_t *itN = bufferFill.ptr<uint16_t>(y);
+        const cv::Vec3b *itNC = color.ptr<cv::Vec3b>(y);
+        const float *itS = &fillSpatial[(y - r + radius) * size];
+
+        for(int x = xL; x <= xH; ++x)
+        {
+          if(!itN[x])
+          {
+            continue;
+          }
+
+          const cv::Vec3b &neighbour = itNC[x];
+          const int diff = std::abs(center[0] - neighbour[0]) + std::abs(center[1] - neighbour[1]) + std::abs(center[2] - neighbour[2]);
+          const float weight = itS[x - c + radius] * fillRange[diff];
+          sumDepth += weight * itN[x];
+          sumWeight += weight;
+        }
+      }
+
+      // Pixels that only have neighbours of very different color are left empty
+      if(sumWeight > 1e-3f)
+      {
+        itO[c] = (uint16_t)(sumDepth / sumWeight + 0.5f);
+      }
+    }
+  });
+}
+
+void DepthRegistration::registerDepth(const cv::Mat &depth, cv::Mat &registered, cv::Mat &cloud)
+{
+  registerDepth(depth, registered);
+  createCloud(registered, NULL, cloud);
+}
+
+void DepthRegistration::registerDepth(const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered, cv::Mat &cloud)
+{
+  if(color.type() != CV_8UC3 || color.rows != sizeRegistered.height || color.cols != sizeRegistered.width)
+  {
+    std::cerr << OUT_NAME("registerDepth") "color image does not match the registered depth image." << std::endl;
+    registerDepth(depth, registered, cloud);
+    return;
+  }
+
+  registerDepth(depth, color, registered);
+  createCloud(registered, &color, cloud);
+}
+
+// The backends only keep the depth of the nearest point of each pixel, so x and y are computed from the ray of the pixel center
+void DepthRegistration::createCloud(const cv::Mat &registered, const cv::Mat *color, cv::Mat &cloud) const
+{
+  const float badPoint = std::numeric_limits<float>::quiet_NaN();
+  const int channels = color ? 4 : 3;
+
+  cloud.create(registered.rows, registered.cols, CV_32FC(channels));
+
+  parallelFor(registered.rows, [&](const int r, const int)
+  {
+    const uint16_t *itD = registered.ptr<uint16_t>(r);
+    const uint8_t *itC = color ? color->ptr<uint8_t>(r) : NULL;
+    float *itP = cloud.ptr<float>(r);
+    const float y = cloudLookupY[r];
+    const float *itX = &cloudLookupX[0];
+
+    for(int c = 0; c < registered.cols; ++c, itP += channels)
+    {
+      const float z = itD[c] / 1000.0f;
+      const bool valid = itD[c] != 0;
+
+      itP[0] = valid ? itX[c] * z : badPoint;
+      itP[1] = valid ? y * z : badPoint;
+      itP[2] = valid ? z : badPoint;
+
+      if(itC)
+      {
+        uint8_t *itBGRA = reinterpret_cast<uint8_t *>(itP + 3);
+        itBGRA[0] = itC[3 * c];
+        itBGRA[1] = itC[3 * c + 1];
+        itBGRA[2] = itC[3 * c + 2];
+        itBGRA[3] = 255;
+      }
+    }
+  });
 }
 
 DepthRegistration *DepthRegistration::New(Method method)
@@ -84,6 +622,86 @@ DepthRegistration *DepthRegistration::New(Method method)
 #else
     std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
     break;
+#endif
+  case CPU_FUSED:
+#ifdef DEPTH_REG_CPU
+    std::cout << OUT_NAME("New") "Using fused CPU registration method!" << std::endl;
+    return new DepthRegistrationCPU(DepthRegistrationCPU::FUSED);
+#else
+    std::cerr << OUT_NAME("New") "CPU registration method not available!" << std::endl;
+    break;
+#endif
+  case CPU_SPARSE:
+#ifdef DEPTH_REG_CPU
+    std::cout << OUT_NAME("New") "Using sparse CPU registration method!" << std::endl;
+    return new DepthRegistrationCPU(DepthRegistrationCPU::SPARSE);
+#else
+    std::cerr << OUT_NAME("New") "CPU registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_ATOMIC:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using atomic OpenCL registration method!" << std::endl;
+    return new DepthRegistrationOpenCL(true);
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_RUNTIME:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using OpenCL registration method with runtime calibration!" << std::endl;
+    return new DepthRegistrationOpenCL(false, true);
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_ATOMIC_RUNTIME:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using atomic OpenCL registration method with runtime calibration!" << std::endl;
+    return new DepthRegistrationOpenCL(true, true);
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_IMAGE:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using OpenCL registration method with image remapping!" << std::endl;
+    return new DepthRegistrationOpenCL(false, false, true);
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_MULTI:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using OpenCL registration method on all devices!" << std::endl;
+    return new DepthRegistrationMultiOpenCL();
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
+#endif
+  case CPU_DOUBLE:
+#ifdef DEPTH_REG_CPU
+    std::cout << OUT_NAME("New") "Using double precision CPU registration method!" << std::endl;
+    return new DepthRegistrationCPU(DepthRegistrationCPU::TWO_PASS, true);
+#else
+    std::cerr << OUT_NAME("New") "CPU registration method not available!" << std::endl;
+    break;
+#endif
+  case CPU_INCREMENTAL:
+#ifdef DEPTH_REG_CPU
+    std::cout << OUT_NAME("New") "Using incremental CPU registration method!" << std::endl;
+    return new DepthRegistrationCPU(DepthRegistrationCPU::INCREMENTAL);
+#else
+    std::cerr << OUT_NAME("New") "CPU registration method not available!" << std::endl;
+    break;
+#endif
+  case OPENCL_MULTI_ATOMIC:
+#ifdef DEPTH_REG_OPENCL
+    std::cout << OUT_NAME("New") "Using atomic OpenCL registration method on all devices!" << std::endl;
+    return new DepthRegistrationMultiOpenCL(true);
+#else
+    std::cerr << OUT_NAME("New") "OpenCL registration method not available!" << std::endl;
+    break;
 #endif
   }
   return NULL;
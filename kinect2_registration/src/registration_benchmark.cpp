@@ -0,0 +1,468 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <kinect2_registration/kinect2_registration.h>
+
+#include "depth_registration_reference.h"
+#include "registration_test_data.h"
+
+// Benchmarks all registration methods on synthetic or recorded depth images, without a sensor. The error of each method is
+// measured against DepthRegistrationReference, a separate implementation of the semantics of the CPU registration. It shows
+// errors of the kernels, lookup tables and SIMD paths, but not errors in the semantics the reference copies on purpose.
+
+struct Method
+{
+  DepthRegistration::Method method;
+  std::string name;
+};
+
+struct Resolution
+{
+  std::string name;
+  cv::Size size;
+  cv::Mat cameraMatrix;
+};
+
+struct Timing
+{
+  double mean, median, p90, p99, max;
+};
+
+struct Error
+{
+  // Pixels valid in both images, mean and maximum absolute difference of them in millimeters
+  size_t compared;
+  double mean, max;
+  // Pixels only valid in one of both images in percent
+  double mismatched;
+};
+
+const Method methods[] =
+{
+  {DepthRegistration::CPU, "cpu"},
+  {DepthRegistration::CPU_FUSED, "cpu_fused"},
+  {DepthRegistration::CPU_SPARSE, "cpu_sparse"},
+  {DepthRegistration::CPU_DOUBLE, "cpu_double"},
+  {DepthRegistration::CPU_INCREMENTAL, "cpu_incremental"},
+  {DepthRegistration::OPENCL, "opencl"},
+  {DepthRegistration::OPENCL_ATOMIC, "opencl_atomic"},
+  {DepthRegistration::OPENCL_RUNTIME, "opencl_runtime"},
+  {DepthRegistration::OPENCL_ATOMIC_RUNTIME, "opencl_atomic_runtime"},
+  {DepthRegistration::OPENCL_IMAGE, "opencl_image"},
+  {DepthRegistration::OPENCL_MULTI, "opencl_multi"},
+  {DepthRegistration::OPENCL_MULTI_ATOMIC, "opencl_multi_atomic"}
+};
+
+bool loadFrames(const std::vector<std::string> &files, std::vector<cv::Mat> &frames)
+{
+  frames.resize(files.size());
+  for(size_t i = 0; i < files.size(); ++i)
+  {
+    frames[i] = cv::imread(files[i], cv::IMREAD_ANYDEPTH);
+    if(frames[i].empty() || frames[i].type() != CV_16U || frames[i].size() != sizeTestDepth)
+    {
+      std::cerr << "could not load 16 bit " << sizeTestDepth.width << "x" << sizeTestDepth.height << " depth image: " << files[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+Timing computeTiming(std::vector<double> &durations)
+{
+  Timing timing;
+  std::sort(durations.begin(), durations.end());
+
+  const size_t last = durations.size() - 1;
+  double sum = 0;
+  for(size_t i = 0; i < durations.size(); ++i)
+  {
+    sum += durations[i];
+  }
+
+  timing.mean = sum / durations.size();
+  timing.median = durations[(size_t)(last * 0.5 + 0.5)];
+  timing.p90 = durations[(size_t)(last * 0.9 + 0.5)];
+  timing.p99 = durations[(size_t)(last * 0.99 + 0.5)];
+  timing.max = durations[last];
+  return timing;
+}
+
+void addError(const cv::Mat &registered, const cv::Mat &reference, Error &error, double &sum, size_t &mismatched)
+{
+  for(int r = 0; r < reference.rows; ++r)
+  {
+    const uint16_t *itR = registered.ptr<uint16_t>(r);
+    const uint16_t *itE = reference.ptr<uint16_t>(r);
+    for(int c = 0; c < reference.cols; ++c, ++itR, ++itE)
+    {
+      if(!*itR || !*itE)
+      {
+        mismatched += (!*itR != !*itE) ? 1 : 0;
+        continue;
+      }
+
+      const double diff = std::abs((double)*itR - (double)*itE);
+      sum += diff;
+      error.max = std::max(error.max, diff);
+      ++error.compared;
+    }
+  }
+}
+
+size_t countDiffering(const cv::Mat &a, const cv::Mat &b)
+{
+  size_t count = 0;
+  for(int r = 0; r < a.rows; ++r)
+  {
+    const uint16_t *itA = a.ptr<uint16_t>(r);
+    const uint16_t *itB = b.ptr<uint16_t>(r);
+    for(int c = 0; c < a.cols; ++c)
+    {
+      count += itA[c] != itB[c] ? 1 : 0;
+    }
+  }
+  return count;
+}
+
+// Synthetic color image for the hole filling, the duration of the filling does not depend on its content
+void createColor(const cv::Size &size, cv::Mat &color)
+{
+  color.create(size, CV_8UC3);
+  for(int r = 0; r < size.height; ++r)
+  {
+    cv::Vec3b *itC = color.ptr<cv::Vec3b>(r);
+    for(int c = 0; c < size.width; ++c)
+    {
+      itC[c] = cv::Vec3b((uint8_t)(255 * c / size.width), (uint8_t)(255 * r / size.height), (uint8_t)(((r / 64 + c / 64) % 2) ? 200 : 50));
+    }
+  }
+}
+
+// Registers with hole filling if a color image is given
+void registerFrame(DepthRegistration *reg, const cv::Mat &depth, const cv::Mat &color, cv::Mat &registered)
+{
+  if(color.empty())
+  {
+    reg->registerDepth(depth, registered);
+  }
+  else
+  {
+    reg->registerDepth(depth, color, registered);
+  }
+}
+
+bool initRegistration(DepthRegistration *reg, const Resolution &resolution, const cv::Mat &cameraMatrixDepth, const cv::Mat &distortionDepth,
+                      const cv::Mat &rotation, const cv::Mat &translation, const int deviceId)
+{
+  return reg->init(resolution.cameraMatrix, resolution.size, cameraMatrixDepth, sizeTestDepth, distortionDepth, rotation, translation,
+                   0.5f, 12.0f, deviceId);
+}
+
+// Registers the same frames alternately with the buffer and the image remapping of OpenCL, so that both see the same clocks and
+// caches, and prints the durations of each stage on the device and the pixels in which both results differ
+void compareRemap(const std::vector<cv::Mat> &frames, const std::vector<Resolution> &resolutions, const cv::Mat &cameraMatrixDepth,
+                  const cv::Mat &distortionDepth, const cv::Mat &rotation, const cv::Mat &translation, const int frameCount, const int warmupCount,
+                  const int deviceId)
+{
+  const Method variants[] = {{DepthRegistration::OPENCL, "buffer"}, {DepthRegistration::OPENCL_IMAGE, "image"}};
+  const size_t count = sizeof(variants) / sizeof(variants[0]);
+
+  std::ostringstream results;
+  results << std::fixed << std::setprecision(3)
+          << std::left << std::setw(5) << "res" << std::setw(8) << "remap" << std::setw(12) << "stage" << std::right
+          << std::setw(9) << "mean" << std::setw(9) << "median" << std::setw(9) << "p90" << std::setw(9) << "p99" << std::setw(9) << "max"
+          << std::endl;
+
+  for(size_t r = 0; r < resolutions.size(); ++r)
+  {
+    const Resolution &resolution = resolutions[r];
+    DepthRegistration *regs[count];
+    bool available = true;
+    for(size_t v = 0; v < count; ++v)
+    {
+      regs[v] = DepthRegistration::New(variants[v].method);
+      if(regs[v])
+      {
+        regs[v]->setProfiling(true);
+      }
+      available = available && regs[v] && initRegistration(regs[v], resolution, cameraMatrixDepth, distortionDepth, rotation, translation,
+                                                                           deviceId);
+    }
+
+    if(available)
+    {
+      cv::Mat registered[count];
+      size_t differing = 0;
+      for(int i = 0; i < warmupCount + frameCount; ++i)
+      {
+        const cv::Mat &depth = frames[i % frames.size()];
+        for(size_t v = 0; v < count; ++v)
+        {
+          regs[v]->registerDepth(depth, registered[v]);
+        }
+        if(i == warmupCount - 1)
+        {
+          // Drops the profile of the warm up frames
+          std::vector<DepthRegistration::ProfileStage> stages;
+          for(size_t v = 0; v < count; ++v)
+          {
+            regs[v]->getProfile(stages, true);
+          }
+        }
+        if(i >= warmupCount)
+        {
+          differing += countDiffering(registered[0], registered[1]);
+        }
+      }
+
+      for(size_t v = 0; v < count; ++v)
+      {
+        std::vector<DepthRegistration::ProfileStage> stages;
+        regs[v]->getProfile(stages);
+        for(size_t i = 0; i < stages.size(); ++i)
+        {
+          const DepthRegistration::ProfileStage &stage = stages[i];
+          results << std::left << std::setw(5) << resolution.name << std::setw(8) << variants[v].name << std::setw(12) << stage.name << std::right
+                  << std::setw(9) << stage.mean << std::setw(9) << stage.median << std::setw(9) << stage.p90 << std::setw(9) << stage.p99
+                  << std::setw(9) << stage.max << std::endl;
+        }
+      }
+      results << std::left << std::setw(5) << resolution.name << "differing pixels: " << std::right
+              << 100.0 * differing / ((double)frameCount * resolution.size.area()) << '%' << std::endl;
+    }
+    else
+    {
+      results << std::left << std::setw(5) << resolution.name << "  not available" << std::endl;
+    }
+
+    for(size_t v = 0; v < count; ++v)
+    {
+      delete regs[v];
+    }
+  }
+
+  std::cout << std::endl << "durations of the stages on the device in ms:" << std::endl << results.str();
+}
+
+void help(const std::string &path)
+{
+  std::cout << path << " [options] [depth images]" << std::endl
+            << "  depth images: 16 bit 512x424 images to use instead of synthetic ones, e.g. saved by kinect2_viewer" << std::endl
+            << "  '-frames <N>': number of measured frames per method and resolution (default 200)" << std::endl
+            << "  '-warmup <N>': number of frames registered before measuring (default 10)" << std::endl
+            << "  '-error <N>':  number of frames compared to the reference (default 20)" << std::endl
+            << "  '-method <NAME>': only benchmark the given method, can be given multiple times" << std::endl
+            << "  '-device <N>': OpenCL device to use (default -1 selects one)" << std::endl
+            << "  '-fill <N>': fill holes with the given radius guided by a synthetic color image (default 0 disables it)" << std::endl
+            << "  '-compare-remap': compare the OpenCL buffer and image remapping on the same frames instead" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  int frameCount = 200, warmupCount = 10, errorCount = 20, deviceId = -1, fillRadius = 0;
+  bool remap = false;
+  std::vector<std::string> files, selected;
+
+  for(int argI = 1; argI < argc; ++argI)
+  {
+    std::string arg(argv[argI]);
+
+    if(arg == "--help" || arg == "--h" || arg == "-h" || arg == "-?" || arg == "--?")
+    {
+      help(argv[0]);
+      return 0;
+    }
+    else if(arg == "-compare-remap")
+    {
+      remap = true;
+    }
+    else if((arg == "-frames" || arg == "-warmup" || arg == "-error" || arg == "-method" || arg == "-device" || arg == "-fill") &&
+            argI + 1 < argc)
+    {
+      const std::string value(argv[++argI]);
+      if(arg == "-frames")
+      {
+        frameCount = std::max(1, atoi(value.c_str()));
+      }
+      else if(arg == "-warmup")
+      {
+        warmupCount = std::max(0, atoi(value.c_str()));
+      }
+      else if(arg == "-error")
+      {
+        errorCount = std::max(0, atoi(value.c_str()));
+      }
+      else if(arg == "-device")
+      {
+        deviceId = atoi(value.c_str());
+      }
+      else if(arg == "-fill")
+      {
+        fillRadius = std::max(0, atoi(value.c_str()));
+      }
+      else
+      {
+        selected.push_back(value);
+      }
+    }
+    else if(arg[0] == '-')
+    {
+      std::cerr << "unknown option: " << arg << std::endl;
+      help(argv[0]);
+      return -1;
+    }
+    else
+    {
+      files.push_back(arg);
+    }
+  }
+
+  std::vector<cv::Mat> frames;
+  if(files.empty())
+  {
+    // Enough different frames that caches do not hold the results of a previous one
+    frames.resize(30);
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      createTestFrame((int)i, frames[i]);
+    }
+  }
+  else if(!loadFrames(files, frames))
+  {
+    return -1;
+  }
+  std::cout << "using " << frames.size() << (files.empty() ? " synthetic" : " recorded") << " depth images." << std::endl;
+
+  cv::Mat cameraMatrixColor, cameraMatrixDepth, distortionDepth, rotation, translation;
+  createTestCalibration(cameraMatrixColor, cameraMatrixDepth, distortionDepth, rotation, translation);
+
+  std::vector<Resolution> resolutions(2);
+  resolutions[0].name = "qhd";
+  resolutions[0].size = cv::Size(960, 540);
+  resolutions[0].cameraMatrix = cameraMatrixColor.clone();
+  resolutions[0].cameraMatrix.at<double>(0, 0) /= 2;
+  resolutions[0].cameraMatrix.at<double>(1, 1) /= 2;
+  resolutions[0].cameraMatrix.at<double>(0, 2) /= 2;
+  resolutions[0].cameraMatrix.at<double>(1, 2) /= 2;
+  resolutions[1].name = "hd";
+  resolutions[1].size = cv::Size(1920, 1080);
+  resolutions[1].cameraMatrix = cameraMatrixColor;
+
+  if(remap)
+  {
+    compareRemap(frames, resolutions, cameraMatrixDepth, distortionDepth, rotation, translation, frameCount, warmupCount, deviceId);
+    return 0;
+  }
+
+  std::ostringstream results;
+  results << std::fixed << std::setprecision(3)
+          << std::left << std::setw(22) << "method" << std::setw(5) << "res" << std::right
+          << std::setw(9) << "mean" << std::setw(9) << "median" << std::setw(9) << "p90" << std::setw(9) << "p99" << std::setw(9) << "max"
+          << std::setw(10) << "Mpx/s" << std::setw(10) << "err mean" << std::setw(9) << "err max" << std::setw(10) << "mismatch" << std::endl;
+
+  for(size_t r = 0; r < resolutions.size(); ++r)
+  {
+    const Resolution &resolution = resolutions[r];
+    const size_t errorFrames = std::min((size_t)errorCount, frames.size());
+
+    cv::Mat color;
+    if(fillRadius)
+    {
+      createColor(resolution.size, color);
+    }
+
+    std::vector<cv::Mat> reference(errorFrames);
+    if(errorFrames)
+    {
+      DepthRegistrationReference reg;
+      reg.init(resolution.cameraMatrix, resolution.size, cameraMatrixDepth, sizeTestDepth, distortionDepth, rotation, translation);
+      for(size_t i = 0; i < errorFrames; ++i)
+      {
+        reg.registerDepth(frames[i], reference[i]);
+      }
+    }
+
+    for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+    {
+      const Method &method = methods[m];
+      if(!selected.empty() && std::find(selected.begin(), selected.end(), method.name) == selected.end())
+      {
+        continue;
+      }
+
+      results << std::left << std::setw(22) << method.name << std::setw(5) << resolution.name << std::right;
+
+      DepthRegistration *reg = DepthRegistration::New(method.method);
+      if(!reg || !initRegistration(reg, resolution, cameraMatrixDepth, distortionDepth, rotation, translation, deviceId))
+      {
+        results << "  not available" << std::endl;
+        delete reg;
+        continue;
+      }
+      reg->setHoleFilling(fillRadius);
+
+      cv::Mat registered;
+      for(int i = 0; i < warmupCount; ++i)
+      {
+        registerFrame(reg, frames[i % frames.size()], color, registered);
+      }
+
+      std::vector<double> durations(frameCount);
+      for(int i = 0; i < frameCount; ++i)
+      {
+        const cv::Mat &depth = frames[i % frames.size()];
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        registerFrame(reg, depth, color, registered);
+        durations[i] = std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(std::chrono::high_resolution_clock::now() - start).count();
+      }
+      const Timing timing = computeTiming(durations);
+
+      Error error = {0, 0, 0, 0};
+      double sum = 0;
+      size_t mismatched = 0;
+      for(size_t i = 0; i < errorFrames; ++i)
+      {
+        registerFrame(reg, frames[i], color, registered);
+        addError(registered, reference[i], error, sum, mismatched);
+      }
+      error.mean = error.compared ? sum / error.compared : 0;
+      error.mismatched = errorFrames ? 100.0 * mismatched / (errorFrames * resolution.size.area()) : 0;
+      delete reg;
+
+      results << std::setw(9) << timing.mean << std::setw(9) << timing.median << std::setw(9) << timing.p90 << std::setw(9) << timing.p99
+              << std::setw(9) << timing.max << std::setw(10) << resolution.size.area() / (timing.mean * 1000.0)
+              << std::setw(10) << error.mean << std::setw(9) << error.max << std::setw(9) << error.mismatched << '%' << std::endl;
+    }
+  }
+
+  std::cout << std::endl << "durations in ms, errors in mm compared to the reference" << (fillRadius ? ", filled holes count as mismatched" : "")
+            << ":" << std::endl << results.str();
+  return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <kinect2_registration/registration_scheduler.h>
+
+#define OUT_NAME(FUNCTION) "[RegistrationThreadPool::" FUNCTION "] "
+
+// Chunks per thread, more chunks balance uneven rows better but need more synchronization
+#define CHUNKS_PER_THREAD 4
+
+RegistrationScheduler::~RegistrationScheduler()
+{
+}
+
+RegistrationThreadPool::RegistrationThreadPool(const int threadCount, const std::vector<int> &cores, const int niceness)
+  : running(true)
+{
+  // The calling thread works on its own loops, so one thread less is enough to use the requested number of cores
+  const int count = std::max(threadCount - 1, 0);
+  threads.reserve(count);
+  jobs.reserve(16);
+  for(int i = 0; i < count; ++i)
+  {
+    const int core = cores.empty() ? -1 : cores[i % cores.size()];
+    threads.push_back(std::thread(&RegistrationThreadPool::threadWorker, this, i, core, niceness));
+  }
+}
+
+RegistrationThreadPool::~RegistrationThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    running = false;
+  }
+  jobAdded.notify_all();
+
+  for(size_t i = 0; i < threads.size(); ++i)
+  {
+    threads[i].join();
+  }
+}
+
+int RegistrationThreadPool::threadCount() const
+{
+  // The calling threads use the index after the pool threads
+  return (int)threads.size() + 1;
+}
+
+void RegistrationThreadPool::parallelFor(const int count, const std::function<void(const int, const int, const int)> &func)
+{
+  if(count <= 0)
+  {
+    return;
+  }
+
+  const int caller = (int)threads.size();
+  if(threads.empty())
+  {
+    func(0, count, caller);
+    return;
+  }
+
+  Job job;
+  job.func = &func;
+  job.count = count;
+  job.chunks = std::min(count, threadCount() * CHUNKS_PER_THREAD);
+  job.chunkSize = (count + job.chunks - 1) / job.chunks;
+  job.chunks = (count + job.chunkSize - 1) / job.chunkSize;
+  job.next = 0;
+  job.done = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobs.push_back(&job);
+  }
+  jobAdded.notify_all();
+
+  int chunk;
+  while(takeChunk(&job, chunk))
+  {
+    runChunk(&job, chunk, caller);
+  }
+
+  std::unique_lock<std::mutex> guard(lock);
+  while(job.done < job.chunks)
+  {
+    jobDone.wait(guard);
+  }
+}
+
+// Takes the next chunk of the job and removes the job from the queue once all of its chunks are taken
+bool RegistrationThreadPool::takeChunk(Job *job, int &chunk)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if(job->next >= job->chunks)
+  {
+    return false;
+  }
+
+  chunk = job->next++;
+  if(job->next == job->chunks)
+  {
+    jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+  }
+  return true;
+}
+
+void RegistrationThreadPool::runChunk(Job *job, const int chunk, const int thread)
+{
+  const int begin = chunk * job->chunkSize;
+  const int end = std::min(begin + job->chunkSize, job->count);
+  (*job->func)(begin, end, thread);
+
+  bool finished;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    finished = ++job->done == job->chunks;
+  }
+  if(finished)
+  {
+    jobDone.notify_all();
+  }
+}
+
+void RegistrationThreadPool::threadWorker(const int id, const int core, const int niceness)
+{
+  if(core >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set))
+    {
+      std::cerr << OUT_NAME("threadWorker") "could not bind thread " << id << " to core " << core << "." << std::endl;
+    }
+  }
+
+  // Like the worker threads of the bridge, nice only changes the priority of the calling thread on Linux
+  if(niceness)
+  {
+    const int oldNice = nice(0);
+    if(nice(niceness - oldNice) == -1 && niceness > oldNice)
+    {
+      std::cerr << OUT_NAME("threadWorker") "could not change the priority of thread " << id << "." << std::endl;
+    }
+  }
+
+  for(;;)
+  {
+    // The chunk has to be taken while holding the lock, a job whose chunks are all taken may finish and go away any time
+    Job *job;
+    int chunk;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      while(running && jobs.empty())
+      {
+        jobAdded.wait(guard);
+      }
+      if(!running)
+      {
+        return;
+      }
+
+      job = jobs.front();
+      chunk = job->next++;
+      if(job->next == job->chunks)
+      {
+        jobs.erase(jobs.begin());
+      }
+    }
+
+    runChunk(job, chunk, id);
+  }
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+
+#include "registration_test_data.h"
+
+void createTestCalibration(cv::Mat &cameraMatrixColor, cv::Mat &cameraMatrixDepth, cv::Mat &distortionDepth, cv::Mat &rotation, cv::Mat &translation)
+{
+  cameraMatrixColor = (cv::Mat_<double>(3, 3) << 1081.37, 0, 959.5, 0, 1081.37, 539.5, 0, 0, 1);
+  cameraMatrixDepth = (cv::Mat_<double>(3, 3) << 365.456, 0, 254.878, 0, 365.456, 205.395, 0, 0, 1);
+  distortionDepth = (cv::Mat_<double>(1, 5) << 0.0905474, -0.26819, 0, 0, 0.0950862);
+  translation = (cv::Mat_<double>(3, 1) << -0.0520, -0.0004, 0.0011);
+
+  // The cameras are mounted almost parallel, the calibration finds rotations of a few tenths of a degree around each axis.
+  // Composed as Rz * Ry * Rx.
+  const double aX = 0.0012, aY = 0.0053, aZ = -0.0023;
+  const double cX = std::cos(aX), sX = std::sin(aX), cY = std::cos(aY), sY = std::sin(aY), cZ = std::cos(aZ), sZ = std::sin(aZ);
+  rotation = (cv::Mat_<double>(3, 3) << cZ * cY, cZ * sY * sX - sZ * cX, cZ * sY * cX + sZ * sX,
+                                        sZ * cY, sZ * sY * sX + cZ * cX, sZ * sY * cX - cZ * sX,
+                                        -sY, cY * sX, cY * cX);
+}
+
+void createTestFrame(const int index, cv::Mat &depth)
+{
+  cv::RNG rng(index + 1);
+  depth.create(sizeTestDepth, CV_16U);
+
+  const double sphereX = 300.0 + 100.0 * std::sin(index * 0.1);
+  const double sphereY = 200.0 + 50.0 * std::cos(index * 0.07);
+  const double sphereR = 70.0;
+
+  for(int r = 0; r < depth.rows; ++r)
+  {
+    uint16_t *itD = depth.ptr<uint16_t>(r);
+    for(int c = 0; c < depth.cols; ++c, ++itD)
+    {
+      double z = 2500.0 + 2.0 * r + c;
+
+      if(c >= 60 && c < 180 && r >= 120 && r < 300)
+      {
+        z = 1500.0;
+      }
+
+      const double dX = c - sphereX;
+      const double dY = r - sphereY;
+      const double d2 = dX * dX + dY * dY;
+      if(d2 < sphereR * sphereR)
+      {
+        z = 1000.0 - 3.0 * std::sqrt(sphereR * sphereR - d2);
+      }
+
+      if(c >= 440 && c < 470 && r >= 30 && r < 60)
+      {
+        z = 350.0;
+      }
+
+      z += rng.gaussian(3.0);
+      *itD = rng.uniform(0.0, 1.0) < 0.02 ? 0 : (uint16_t)z;
+    }
+  }
+}
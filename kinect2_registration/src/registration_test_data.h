@@ -0,0 +1,36 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#ifndef __REGISTRATION_TEST_DATA_H__
+#define __REGISTRATION_TEST_DATA_H__
+
+#include <opencv2/opencv.hpp>
+
+// Synthetic calibration and depth images of a Kinect v2, shared by the benchmark and the tests so that neither needs a sensor.
+// Not part of the library.
+
+const cv::Size sizeTestDepth(512, 424);
+
+// Typical factory calibration of a Kinect v2
+void createTestCalibration(cv::Mat &cameraMatrixColor, cv::Mat &cameraMatrixDepth, cv::Mat &distortionDepth, cv::Mat &rotation, cv::Mat &translation);
+
+// Tilted wall with a box, a sphere moving across the image, a patch closer than zNear, sensor noise and missing pixels. Frames
+// with different indices differ in the position of the sphere and in the noise.
+void createTestFrame(const int index, cv::Mat &depth);
+
+#endif //__REGISTRATION_TEST_DATA_H__
@@ -0,0 +1,180 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "registration_test.h"
+#include "registration_test_data.h"
+
+const TestMethod testMethods[] =
+{
+  {DepthRegistration::CPU, "cpu"},
+  {DepthRegistration::CPU_FUSED, "cpu_fused"},
+  {DepthRegistration::CPU_SPARSE, "cpu_sparse"},
+  {DepthRegistration::CPU_DOUBLE, "cpu_double"},
+  {DepthRegistration::CPU_INCREMENTAL, "cpu_incremental"},
+  {DepthRegistration::OPENCL, "opencl"},
+  {DepthRegistration::OPENCL_ATOMIC, "opencl_atomic"},
+  {DepthRegistration::OPENCL_RUNTIME, "opencl_runtime"},
+  {DepthRegistration::OPENCL_ATOMIC_RUNTIME, "opencl_atomic_runtime"},
+  {DepthRegistration::OPENCL_IMAGE, "opencl_image"},
+  {DepthRegistration::OPENCL_MULTI, "opencl_multi"},
+  {DepthRegistration::OPENCL_MULTI_ATOMIC, "opencl_multi_atomic"}
+};
+const size_t testMethodCount = sizeof(testMethods) / sizeof(testMethods[0]);
+
+TestSetup::TestSetup()
+  : sizeHD(1920, 1080), sizeQHD(960, 540)
+{
+  createTestCalibration(cameraMatrixHD, cameraMatrixDepth, distortionDepth, rotation, translation);
+
+  cameraMatrixQHD = cameraMatrixHD.clone();
+  cameraMatrixQHD.at<double>(0, 0) /= 2;
+  cameraMatrixQHD.at<double>(1, 1) /= 2;
+  cameraMatrixQHD.at<double>(0, 2) /= 2;
+  cameraMatrixQHD.at<double>(1, 2) /= 2;
+}
+
+const cv::Mat &TestSetup::cameraMatrix(const bool hd) const
+{
+  return hd ? cameraMatrixHD : cameraMatrixQHD;
+}
+
+const cv::Size &TestSetup::size(const bool hd) const
+{
+  return hd ? sizeHD : sizeQHD;
+}
+
+TestError::TestError(const int tolerance)
+  : tolerance(tolerance), compared(0), outliers(0), mean(0), mismatched(0), total(0)
+{
+}
+
+void TestError::add(const cv::Mat &registered, const cv::Mat &reference)
+{
+  double sum = mean * compared;
+  for(int r = 0; r < reference.rows; ++r)
+  {
+    const uint16_t *itR = registered.ptr<uint16_t>(r);
+    const uint16_t *itE = reference.ptr<uint16_t>(r);
+    for(int c = 0; c < reference.cols; ++c)
+    {
+      if(!itR[c] || !itE[c])
+      {
+        mismatched += (!itR[c] != !itE[c]) ? 1 : 0;
+        continue;
+      }
+
+      const int diff = std::abs(itR[c] - itE[c]);
+      sum += diff;
+      outliers += diff > tolerance ? 1 : 0;
+      ++compared;
+    }
+  }
+  total += reference.total();
+  mean = compared ? sum / compared : 0;
+}
+
+double TestError::outlierRatio() const
+{
+  return compared ? outliers / (double)compared : 0;
+}
+
+double TestError::mismatchRatio() const
+{
+  return total ? mismatched / (double)total : 0;
+}
+
+DepthRegistration *createTestRegistration(const DepthRegistration::Method method, const TestSetup &setup, const bool hd)
+{
+  DepthRegistration *reg = DepthRegistration::New(method);
+  if(reg && !reg->init(setup.cameraMatrix(hd), setup.size(hd), setup.cameraMatrixDepth, sizeTestDepth, setup.distortionDepth, setup.rotation,
+                       setup.translation))
+  {
+    delete reg;
+    reg = NULL;
+  }
+  return reg;
+}
+
+void createTestSequence(const size_t count, std::vector<cv::Mat> &frames)
+{
+  cv::Mat base;
+  createTestFrame(0, base);
+
+  frames.resize(count);
+  for(size_t i = 0; i < count; ++i)
+  {
+    frames[i] = base.clone();
+    const cv::Rect box(100 + 25 * (int)i, 150 + 10 * (int)i, 40, 40);
+    frames[i](box).setTo(1200);
+  }
+}
+
+bool equalImages(const cv::Mat &a, const cv::Mat &b)
+{
+  if(a.size() != b.size() || a.type() != b.type())
+  {
+    return false;
+  }
+
+  for(int r = 0; r < a.rows; ++r)
+  {
+    if(memcmp(a.ptr<uint8_t>(r), b.ptr<uint8_t>(r), a.cols * a.elemSize()))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool isDeterministic(const DepthRegistration::Method method)
+{
+  switch(method)
+  {
+  case DepthRegistration::OPENCL:
+  case DepthRegistration::OPENCL_RUNTIME:
+  case DepthRegistration::OPENCL_IMAGE:
+  case DepthRegistration::OPENCL_MULTI:
+    return false;
+  default:
+    return true;
+  }
+}
+
+bool sameResult(const cv::Mat &a, const cv::Mat &b, const bool deterministic)
+{
+  if(deterministic || a.size() != b.size() || a.type() != b.type())
+  {
+    return equalImages(a, b);
+  }
+
+  size_t differing = 0;
+  for(int r = 0; r < a.rows; ++r)
+  {
+    const uint16_t *itA = a.ptr<uint16_t>(r);
+    const uint16_t *itB = b.ptr<uint16_t>(r);
+    for(int c = 0; c < a.cols; ++c)
+    {
+      differing += std::abs(itA[c] - itB[c]) > 0.01 * std::max(itA[c], itB[c]) ? 1 : 0;
+    }
+  }
+  return differing <= a.total() / 100;
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#ifndef __REGISTRATION_TEST_H__
+#define __REGISTRATION_TEST_H__
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <kinect2_registration/kinect2_registration.h>
+
+struct TestMethod
+{
+  DepthRegistration::Method method;
+  std::string name;
+};
+
+// Calibration and camera models of the QHD and HD images used by all tests
+struct TestSetup
+{
+  cv::Mat cameraMatrixHD, cameraMatrixQHD, cameraMatrixDepth, distortionDepth, rotation, translation;
+  cv::Size sizeHD, sizeQHD;
+
+  TestSetup();
+
+  const cv::Mat &cameraMatrix(const bool hd) const;
+  const cv::Size &size(const bool hd) const;
+};
+
+// Differences of a registered image to a reference
+struct TestError
+{
+  // Pixels valid in both images, pixels of them differing by more than the tolerance and the mean absolute difference, all
+  // differences in millimeters
+  int tolerance;
+  size_t compared, outliers;
+  double mean;
+  // Pixels only valid in one of both images
+  size_t mismatched, total;
+
+  TestError(const int tolerance = 2);
+
+  void add(const cv::Mat &registered, const cv::Mat &reference);
+  double outlierRatio() const;
+  double mismatchRatio() const;
+};
+
+extern const TestMethod testMethods[];
+extern const size_t testMethodCount;
+
+// Creates the method and initializes it for the QHD or HD image. Returns NULL if the method is not available, e.g. because
+// there is no OpenCL device.
+DepthRegistration *createTestRegistration(const DepthRegistration::Method method, const TestSetup &setup, const bool hd);
+
+// Depth images of a static scene in which only a box moves, so that the incremental method has something to skip
+void createTestSequence(const size_t count, std::vector<cv::Mat> &frames);
+
+bool equalImages(const cv::Mat &a, const cv::Mat &b);
+
+// The non-atomic OpenCL kernels resolve pixels hit by several points in the order the work items run in, so two registrations
+// of the same frame may differ at depth edges. All other methods give the same image for the same input.
+bool isDeterministic(const DepthRegistration::Method method);
+
+// Exact match for deterministic methods, otherwise at most 1% of the pixels may differ by more than 1%
+bool sameResult(const cv::Mat &a, const cv::Mat &b, const bool deterministic);
+
+#endif //__REGISTRATION_TEST_H__
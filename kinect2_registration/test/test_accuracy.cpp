@@ -0,0 +1,118 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "depth_registration_reference.h"
+#include "registration_test.h"
+#include "registration_test_data.h"
+
+// Bounds of the difference to the reference implementation. The dense CPU methods only differ by the rounding of single
+// precision. The sparse method fills the pixels between the projected depth pixels and covers occluded ones differently at depth
+// edges. The OpenCL kernels write each point into the four pixels around its projection instead of the one it falls into, so
+// pixels get the depth of a neighboring point. The atomic kernels keep the nearest of these, the others any within 1% of it and
+// at depth edges sometimes one of the background, depending on the order the work items run in. The OpenCL bounds are about
+// twice the differences measured on the test sequence, the mean of the non-atomic kernels has more room for that order.
+struct AccuracyBounds
+{
+  // Tolerance of the outliers in millimeters, bounds of the mean difference in millimeters and of the ratios
+  int tolerance;
+  double mean, outliers, mismatched;
+};
+
+static AccuracyBounds accuracyBounds(const DepthRegistration::Method method)
+{
+  const AccuracyBounds dense = {2, 0.01, 1e-4, 1e-4};
+  const AccuracyBounds sparse = {20, 20.0, 0.05, 0.1};
+  const AccuracyBounds openCL = {20, 10.0, 0.01, 0.02};
+  const AccuracyBounds openCLAtomic = {20, 6.0, 0.01, 0.02};
+
+  switch(method)
+  {
+  case DepthRegistration::CPU_SPARSE:
+    return sparse;
+  case DepthRegistration::OPENCL:
+  case DepthRegistration::OPENCL_RUNTIME:
+  case DepthRegistration::OPENCL_IMAGE:
+  case DepthRegistration::OPENCL_MULTI:
+    return openCL;
+  case DepthRegistration::OPENCL_ATOMIC:
+  case DepthRegistration::OPENCL_ATOMIC_RUNTIME:
+  case DepthRegistration::OPENCL_MULTI_ATOMIC:
+    return openCLAtomic;
+  default:
+    return dense;
+  }
+}
+
+// Registers a sequence with every available method and compares the results to the independent reference implementation
+class AccuracyTest : public testing::TestWithParam<bool>
+{
+protected:
+  TestSetup setup;
+  std::vector<cv::Mat> frames, reference;
+
+  void SetUp()
+  {
+    createTestSequence(5, frames);
+
+    DepthRegistrationReference reg;
+    reg.init(setup.cameraMatrix(GetParam()), setup.size(GetParam()), setup.cameraMatrixDepth, sizeTestDepth, setup.distortionDepth,
+             setup.rotation, setup.translation);
+    reference.resize(frames.size());
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg.registerDepth(frames[i], reference[i]);
+    }
+  }
+};
+
+TEST_P(AccuracyTest, MatchesReference)
+{
+  for(size_t m = 0; m < testMethodCount; ++m)
+  {
+    const TestMethod &method = testMethods[m];
+    DepthRegistration *reg = createTestRegistration(method.method, setup, GetParam());
+    if(!reg)
+    {
+      std::cout << "skipping " << method.name << ", not available." << std::endl;
+      continue;
+    }
+
+    const AccuracyBounds bounds = accuracyBounds(method.method);
+    TestError error(bounds.tolerance);
+    cv::Mat registered;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg->registerDepth(frames[i], registered);
+      ASSERT_EQ(reference[i].size(), registered.size()) << method.name;
+      error.add(registered, reference[i]);
+    }
+    delete reg;
+
+    std::cout << method.name << ": mean " << error.mean << " mm, outliers " << 100.0 * error.outlierRatio() << "%, mismatched "
+              << 100.0 * error.mismatchRatio() << '%' << std::endl;
+
+    EXPECT_LT(error.mean, bounds.mean) << method.name;
+    EXPECT_LT(error.outlierRatio(), bounds.outliers) << method.name;
+    EXPECT_LT(error.mismatchRatio(), bounds.mismatched) << method.name;
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Resolutions, AccuracyTest, testing::Values(false, true));
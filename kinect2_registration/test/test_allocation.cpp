@@ -0,0 +1,149 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <sstream>
+
+#include <gtest/gtest.h>
+
+#include <kinect2_registration/registration_scheduler.h>
+
+#include "registration_test.h"
+
+// Counts all allocations of the test executable, the registration must not add any once it registered a frame
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size)
+{
+  ++allocations;
+  void *p = malloc(size ? size : 1);
+  if(!p)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+// Registers alternating frames, so that the incremental method has changes to register every time. Returns the number of
+// allocations of the calls after the warm up. OpenCV allocates the data of images with malloc, so the images registered into
+// also have to keep their data.
+static size_t countAllocations(DepthRegistration *reg, const std::vector<cv::Mat> &frames, const bool batch, const bool async,
+                               bool &sameImages)
+{
+  cv::Mat registered;
+  std::vector<cv::Mat> registeredTargets;
+  std::vector<const uint8_t *> data;
+  size_t before = 0;
+  sameImages = true;
+  for(int i = 0; i < 8; ++i)
+  {
+    if(i == 3)
+    {
+      data.reserve(registeredTargets.size() + 1);
+      before = allocations;
+      data.push_back(registered.data);
+      for(size_t t = 0; t < registeredTargets.size(); ++t)
+      {
+        data.push_back(registeredTargets[t].data);
+      }
+    }
+
+    const cv::Mat &depth = frames[i % frames.size()];
+    if(batch)
+    {
+      reg->registerDepth(depth, registeredTargets);
+    }
+    else if(async)
+    {
+      reg->registerDepthAsync(depth, registered);
+    }
+    else
+    {
+      reg->registerDepth(depth, registered);
+    }
+  }
+
+  const size_t count = allocations - before;
+  sameImages = data[0] == registered.data && data.size() == registeredTargets.size() + 1;
+  for(size_t t = 0; t < registeredTargets.size() && sameImages; ++t)
+  {
+    sameImages = data[t + 1] == registeredTargets[t].data;
+  }
+  return count;
+}
+
+TEST(AllocationTest, NoAllocationsAfterWarmUp)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(2, frames);
+
+  const DepthRegistration::Method methods[] =
+  {
+    DepthRegistration::CPU,
+    DepthRegistration::CPU_FUSED,
+    DepthRegistration::CPU_SPARSE,
+    DepthRegistration::CPU_DOUBLE,
+    DepthRegistration::CPU_INCREMENTAL
+  };
+  std::shared_ptr<RegistrationScheduler> pool(new RegistrationThreadPool(4));
+
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    for(int variant = 0; variant < 8; ++variant)
+    {
+      const bool batch = variant & 1;
+      const bool threadPool = variant & 2;
+      const bool async = variant & 4;
+      if(batch && async)
+      {
+        continue;
+      }
+      DepthRegistration *reg = createTestRegistration(methods[m], setup, true);
+      ASSERT_TRUE(reg != NULL);
+      if(threadPool)
+      {
+        reg->setScheduler(pool);
+      }
+      if(batch)
+      {
+        ASSERT_TRUE(reg->addTarget(setup.cameraMatrixQHD, setup.sizeQHD));
+      }
+
+      std::ostringstream oss;
+      oss << "method " << methods[m] << (batch ? ", batch" : "") << (async ? ", async" : "") << (threadPool ? ", thread pool" : ", OpenMP");
+
+      bool sameImages;
+      EXPECT_EQ(0u, countAllocations(reg, frames, batch, async, sameImages)) << oss.str();
+      EXPECT_TRUE(sameImages) << oss.str();
+      delete reg;
+    }
+  }
+}
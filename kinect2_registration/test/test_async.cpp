@@ -0,0 +1,113 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "registration_test.h"
+
+// The pipelined registration returns the registered image of an earlier call, which has to be the same as the synchronous
+// registration of that frame. Each result is kept in its own image, so that a registration writing into an image it already
+// handed out is detected as well.
+TEST(AsyncTest, MatchesSynchronous)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(6, frames);
+
+  for(size_t m = 0; m < testMethodCount; ++m)
+  {
+    const TestMethod &method = testMethods[m];
+    DepthRegistration *reg = createTestRegistration(method.method, setup, false);
+    DepthRegistration *regAsync = createTestRegistration(method.method, setup, false);
+    if(!reg || !regAsync)
+    {
+      std::cout << "skipping " << method.name << ", not available." << std::endl;
+      delete reg;
+      delete regAsync;
+      continue;
+    }
+    const bool deterministic = isDeterministic(method.method);
+
+    std::vector<cv::Mat> expected(frames.size());
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg->registerDepth(frames[i], expected[i]);
+    }
+    delete reg;
+
+    // Nothing was started yet
+    cv::Mat unused;
+    EXPECT_FALSE(regAsync->finishDepthAsync(unused)) << method.name;
+
+    // Back to back starts. Once the pipeline is full, each one returns the oldest frame in it. The multi device method keeps
+    // one frame per device in flight, all others one.
+    std::vector<cv::Mat> results;
+    size_t latency = 0;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      cv::Mat result;
+      if(regAsync->registerDepthAsync(frames[i], result))
+      {
+        results.push_back(result);
+      }
+      else
+      {
+        EXPECT_TRUE(results.empty()) << method.name << ", frame " << i;
+        ++latency;
+      }
+    }
+    EXPECT_GE(latency, 1u) << method.name;
+    for(cv::Mat result; regAsync->finishDepthAsync(result); result = cv::Mat())
+    {
+      results.push_back(result);
+    }
+    EXPECT_FALSE(regAsync->finishDepthAsync(unused)) << method.name;
+
+    ASSERT_EQ(frames.size(), results.size()) << method.name;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      EXPECT_TRUE(sameResult(expected[i], results[i], deterministic)) << method.name << ", frame " << i;
+    }
+
+    // The pipeline starts over after it was finished
+    std::vector<size_t> indices;
+    std::vector<cv::Mat> restarted;
+    for(size_t i = 0; i <= latency; ++i)
+    {
+      cv::Mat result;
+      indices.push_back((2 + i) % frames.size());
+      EXPECT_EQ(i == latency, regAsync->registerDepthAsync(frames[indices.back()], result)) << method.name;
+      if(i == latency)
+      {
+        restarted.push_back(result);
+      }
+    }
+    for(cv::Mat result; regAsync->finishDepthAsync(result); result = cv::Mat())
+    {
+      restarted.push_back(result);
+    }
+    ASSERT_EQ(indices.size(), restarted.size()) << method.name;
+    for(size_t i = 0; i < indices.size(); ++i)
+    {
+      EXPECT_TRUE(sameResult(expected[indices[i]], restarted[i], deterministic)) << method.name << ", restarted frame " << i;
+    }
+
+    delete regAsync;
+  }
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+#include <kinect2_registration/registration_scheduler.h>
+
+#include "registration_test.h"
+
+// Pixels hit by several depth pixels keep the nearest value, written with an atomic minimum. The result must not depend on
+// the number of threads or the order they run in, so repeated runs with OpenMP and with a thread pool have to give the same
+// images. The HD image is used, because more depth pixels share a registered pixel there.
+TEST(DeterminismTest, SameResultForAllRuns)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(2, frames);
+
+  const DepthRegistration::Method methods[] =
+  {
+    DepthRegistration::CPU,
+    DepthRegistration::CPU_FUSED,
+    DepthRegistration::CPU_SPARSE,
+    DepthRegistration::CPU_DOUBLE,
+    DepthRegistration::CPU_INCREMENTAL
+  };
+  const int runs = 3;
+  std::shared_ptr<RegistrationScheduler> pool(new RegistrationThreadPool(8));
+
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    std::vector<cv::Mat> expected;
+    for(int run = 0; run < 2 * runs; ++run)
+    {
+      // A new registration each run, so that the incremental method registers the first frame completely and the second one
+      // incrementally every time
+      DepthRegistration *reg = createTestRegistration(methods[m], setup, true);
+      if(!reg)
+      {
+        break;
+      }
+      if(run >= runs)
+      {
+        reg->setScheduler(pool);
+      }
+
+      for(size_t i = 0; i < frames.size(); ++i)
+      {
+        cv::Mat registered;
+        reg->registerDepth(frames[i], registered);
+        if(expected.size() <= i)
+        {
+          expected.push_back(registered);
+          continue;
+        }
+        EXPECT_TRUE(equalImages(expected[i], registered)) << "method " << methods[m] << ", run " << run << ", frame " << i;
+      }
+      delete reg;
+    }
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include "registration_test.h"
+
+// Registers the HD image and the QHD image as additional target, as the bridge does when both are subscribed
+static DepthRegistration *createBatchRegistration(const DepthRegistration::Method method, const TestSetup &setup)
+{
+  DepthRegistration *reg = createTestRegistration(method, setup, true);
+  if(reg && !reg->addTarget(setup.cameraMatrixQHD, setup.sizeQHD))
+  {
+    delete reg;
+    reg = NULL;
+  }
+  return reg;
+}
+
+// The incremental method only registers the changed parts again, but has to give the same result as registering every frame
+TEST(IncrementalTest, MatchesFullRegistration)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(5, frames);
+
+  DepthRegistration *full = createTestRegistration(DepthRegistration::CPU, setup, false);
+  DepthRegistration *incremental = createTestRegistration(DepthRegistration::CPU_INCREMENTAL, setup, false);
+  ASSERT_TRUE(full && incremental);
+
+  cv::Mat expected, registered;
+  for(size_t i = 0; i < frames.size(); ++i)
+  {
+    full->registerDepth(frames[i], expected);
+    incremental->registerDepth(frames[i], registered);
+    EXPECT_TRUE(equalImages(expected, registered)) << "frame " << i;
+  }
+  delete full;
+  delete incremental;
+}
+
+TEST(IncrementalTest, MatchesFullRegistrationOfTargets)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(5, frames);
+  // A static frame in between, which is not registered again
+  frames.insert(frames.begin() + 2, frames[1].clone());
+
+  DepthRegistration *full = createBatchRegistration(DepthRegistration::CPU, setup);
+  DepthRegistration *incremental = createBatchRegistration(DepthRegistration::CPU_INCREMENTAL, setup);
+  ASSERT_TRUE(full && incremental);
+
+  std::vector<cv::Mat> expected, registered;
+  for(size_t i = 0; i < frames.size(); ++i)
+  {
+    full->registerDepth(frames[i], expected);
+    incremental->registerDepth(frames[i], registered);
+    ASSERT_EQ(expected.size(), registered.size());
+    for(size_t t = 0; t < expected.size(); ++t)
+    {
+      EXPECT_TRUE(equalImages(expected[t], registered[t])) << "frame " << i << ", target " << t;
+    }
+  }
+
+  // Switching between single and batch registration starts over
+  cv::Mat expectedSingle, registeredSingle;
+  full->registerDepth(frames[0], expectedSingle);
+  incremental->registerDepth(frames[0], registeredSingle);
+  EXPECT_TRUE(equalImages(expectedSingle, registeredSingle));
+  full->registerDepth(frames[1], expected);
+  incremental->registerDepth(frames[1], registered);
+  for(size_t t = 0; t < expected.size(); ++t)
+  {
+    EXPECT_TRUE(equalImages(expected[t], registered[t])) << "target " << t;
+  }
+
+  delete full;
+  delete incremental;
+}
@@ -0,0 +1,496 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "registration_test.h"
+#include "registration_test_data.h"
+
+// The atomic method keeps the nearest depth of each pixel, the original one keeps a value within 1% of the nearest one and
+// depends on the execution order at depth edges. Both have to agree within 1% on all but the pixels at the edges, which are
+// about 0.5% of the test images.
+class OpenCLAtomicTest : public testing::TestWithParam<bool>
+{
+};
+
+TEST_P(OpenCLAtomicTest, MatchesNonAtomic)
+{
+  TestSetup setup;
+  DepthRegistration *reg = createTestRegistration(DepthRegistration::OPENCL, setup, GetParam());
+  DepthRegistration *regAtomic = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, GetParam());
+  if(!reg || !regAtomic)
+  {
+    std::cout << "skipping, no OpenCL device available." << std::endl;
+    delete reg;
+    delete regAtomic;
+    return;
+  }
+
+  std::vector<cv::Mat> frames;
+  createTestSequence(5, frames);
+
+  size_t compared = 0, outliers = 0, mismatched = 0, total = 0;
+  cv::Mat registered, registeredAtomic;
+  for(size_t i = 0; i < frames.size(); ++i)
+  {
+    reg->registerDepth(frames[i], registered);
+    regAtomic->registerDepth(frames[i], registeredAtomic);
+    ASSERT_EQ(registered.size(), registeredAtomic.size());
+
+    for(int r = 0; r < registered.rows; ++r)
+    {
+      const uint16_t *itR = registered.ptr<uint16_t>(r);
+      const uint16_t *itA = registeredAtomic.ptr<uint16_t>(r);
+      for(int c = 0; c < registered.cols; ++c)
+      {
+        if(!itR[c] || !itA[c])
+        {
+          mismatched += (!itR[c] != !itA[c]) ? 1 : 0;
+          continue;
+        }
+        outliers += std::abs(itR[c] - itA[c]) > 0.01 * std::max(itR[c], itA[c]) ? 1 : 0;
+        ++compared;
+      }
+    }
+    total += registered.total();
+  }
+  delete reg;
+  delete regAtomic;
+
+  std::cout << "outliers " << 100.0 * outliers / compared << "%, mismatched " << 100.0 * mismatched / total << '%' << std::endl;
+  ASSERT_GT(compared, total / 2);
+  EXPECT_LT(outliers, compared / 100);
+  EXPECT_LT(mismatched, total / 100);
+}
+
+INSTANTIATE_TEST_CASE_P(Resolutions, OpenCLAtomicTest, testing::Values(false, true));
+
+// Points XDG_CACHE_HOME to an empty directory during the test, so that the program and work group caches start empty and are
+// not shared with other runs
+class OpenCLCacheTest : public testing::Test
+{
+protected:
+  std::string directory, previous;
+  bool hadPrevious;
+
+  void SetUp()
+  {
+    char path[] = "/tmp/kinect2_registration_test_XXXXXX";
+    ASSERT_TRUE(mkdtemp(path) != NULL);
+    directory = path;
+
+    const char *value = getenv("XDG_CACHE_HOME");
+    hadPrevious = value != NULL;
+    previous = hadPrevious ? value : "";
+    setenv("XDG_CACHE_HOME", directory.c_str(), 1);
+  }
+
+  void TearDown()
+  {
+    if(hadPrevious)
+    {
+      setenv("XDG_CACHE_HOME", previous.c_str(), 1);
+    }
+    else
+    {
+      unsetenv("XDG_CACHE_HOME");
+    }
+
+    const std::vector<std::string> files = cacheFiles("");
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+      std::remove(files[i].c_str());
+    }
+    rmdir((directory + "/kinect2_registration").c_str());
+    rmdir(directory.c_str());
+  }
+
+  // Files in the cache directory of the library ending with the given suffix, sorted by name
+  std::vector<std::string> cacheFiles(const std::string &suffix) const
+  {
+    std::vector<std::string> files;
+    const std::string path = directory + "/kinect2_registration";
+    DIR *dir = opendir(path.c_str());
+    if(!dir)
+    {
+      return files;
+    }
+
+    for(struct dirent *entry = readdir(dir); entry; entry = readdir(dir))
+    {
+      const std::string name = entry->d_name;
+      if(name != "." && name != ".." && name.size() >= suffix.size() && !name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+      {
+        files.push_back(path + "/" + name);
+      }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  // The caches are written to a temporary file that replaces the old one, so a new inode means the file was written again
+  static ino_t fileId(const std::string &file)
+  {
+    struct stat info;
+    return stat(file.c_str(), &info) == 0 ? info.st_ino : 0;
+  }
+};
+
+// A new registration loads the program binary cached by an earlier one, once no other registration shares the program in this
+// process anymore. A corrupt binary is compiled again and replaced.
+TEST_F(OpenCLCacheTest, ReusesProgramBinary)
+{
+  TestSetup setup;
+  cv::Mat depth, expected, registered;
+  createTestFrame(0, depth);
+
+  DepthRegistration *reg = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, false);
+  if(!reg)
+  {
+    std::cout << "skipping, no OpenCL device available." << std::endl;
+    return;
+  }
+  reg->registerDepth(depth, expected);
+  delete reg;
+
+  const std::vector<std::string> binaries = cacheFiles(".bin");
+  ASSERT_EQ(1u, binaries.size());
+  const ino_t compiled = fileId(binaries[0]);
+
+  reg = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, false);
+  ASSERT_TRUE(reg != NULL);
+  reg->registerDepth(depth, registered);
+  delete reg;
+  EXPECT_TRUE(equalImages(expected, registered));
+  EXPECT_EQ(binaries, cacheFiles(".bin"));
+  EXPECT_EQ(compiled, fileId(binaries[0]));
+
+  {
+    std::ofstream file(binaries[0].c_str(), std::ios::binary | std::ios::trunc);
+    file << "corrupt";
+  }
+  const ino_t corrupt = fileId(binaries[0]);
+
+  reg = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, false);
+  ASSERT_TRUE(reg != NULL);
+  reg->registerDepth(depth, registered);
+  delete reg;
+  EXPECT_TRUE(equalImages(expected, registered));
+  EXPECT_NE(corrupt, fileId(binaries[0]));
+}
+
+// The work group size is tuned once and stored next to the program binary, later registrations use the stored one. Registrations
+// created at the same time tune it concurrently and have to agree on one.
+TEST_F(OpenCLCacheTest, StoresTunedWorkGroups)
+{
+  TestSetup setup;
+  cv::Mat depth;
+  createTestFrame(0, depth);
+
+  std::vector<DepthRegistration *> regs(2, NULL);
+  std::vector<cv::Mat> registered(regs.size());
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < regs.size(); ++i)
+  {
+    threads.push_back(std::thread([&, i]()
+    {
+      regs[i] = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, false);
+      if(regs[i])
+      {
+        regs[i]->registerDepth(depth, registered[i]);
+      }
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); ++i)
+  {
+    threads[i].join();
+  }
+  if(!regs[0] || !regs[1])
+  {
+    std::cout << "skipping, no OpenCL device available." << std::endl;
+    delete regs[0];
+    delete regs[1];
+    return;
+  }
+  delete regs[0];
+  delete regs[1];
+  EXPECT_TRUE(equalImages(registered[0], registered[1]));
+
+  const std::vector<std::string> files = cacheFiles(".workgroups");
+  ASSERT_EQ(1u, files.size());
+  size_t localX = 1, localY = 1;
+  {
+    std::ifstream file(files[0].c_str());
+    ASSERT_TRUE(file >> localX >> localY);
+  }
+  if(localX)
+  {
+    EXPECT_EQ(0u, setup.sizeQHD.width % localX);
+    EXPECT_EQ(0u, setup.sizeQHD.height % localY);
+  }
+  else
+  {
+    EXPECT_EQ(0u, localY);
+  }
+  const ino_t tuned = fileId(files[0]);
+
+  cv::Mat reused;
+  DepthRegistration *reg = createTestRegistration(DepthRegistration::OPENCL_ATOMIC, setup, false);
+  ASSERT_TRUE(reg != NULL);
+  reg->registerDepth(depth, reused);
+  delete reg;
+  EXPECT_TRUE(equalImages(registered[0], reused));
+  EXPECT_EQ(tuned, fileId(files[0]));
+}
+
+// Registering from the host buffers of getHostBuffers, which the kernels use directly on devices with unified memory, has to
+// give the same images as registering from ordinary images, also when the host buffers are reused for every frame
+TEST(OpenCLDeviceTest, HostBuffersMatchCopies)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(3, frames);
+
+  const DepthRegistration::Method methods[] = {DepthRegistration::OPENCL, DepthRegistration::OPENCL_ATOMIC};
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    DepthRegistration *reg = createTestRegistration(methods[m], setup, false);
+    DepthRegistration *regHost = createTestRegistration(methods[m], setup, false);
+    if(!reg || !regHost)
+    {
+      std::cout << "skipping, no OpenCL device available." << std::endl;
+      delete reg;
+      delete regHost;
+      return;
+    }
+
+    cv::Mat depthHost, registeredHost, expected;
+    regHost->getHostBuffers(depthHost, registeredHost);
+    ASSERT_EQ(frames[0].size(), depthHost.size());
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg->registerDepth(frames[i], expected);
+      frames[i].copyTo(depthHost);
+      regHost->registerDepth(depthHost, registeredHost);
+      EXPECT_TRUE(sameResult(expected, registeredHost, isDeterministic(methods[m]))) << "method " << m << ", frame " << i;
+    }
+    delete reg;
+    delete regHost;
+  }
+}
+
+// Updating the calibration has to give the same images as initializing with the new one, both when the camera model is passed to
+// the kernels at runtime and when the program is rebuilt with it
+TEST(OpenCLDeviceTest, UpdatedCalibrationMatchesInit)
+{
+  TestSetup setup, changed;
+  changed.cameraMatrixQHD = setup.cameraMatrixQHD.clone();
+  changed.cameraMatrixQHD.at<double>(0, 0) *= 1.02;
+  changed.translation = setup.translation.clone();
+  changed.translation.at<double>(0, 0) += 0.01;
+
+  std::vector<cv::Mat> frames;
+  createTestSequence(2, frames);
+
+  const DepthRegistration::Method methods[] = {DepthRegistration::OPENCL_ATOMIC_RUNTIME, DepthRegistration::OPENCL_ATOMIC};
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    DepthRegistration *reg = createTestRegistration(methods[m], setup, false);
+    DepthRegistration *regInit = createTestRegistration(methods[m], changed, false);
+    if(!reg || !regInit)
+    {
+      std::cout << "skipping, no OpenCL device available." << std::endl;
+      delete reg;
+      delete regInit;
+      return;
+    }
+
+    cv::Mat original, registered, expected;
+    reg->registerDepth(frames[0], original);
+    ASSERT_TRUE(reg->updateCalibration(changed.cameraMatrixQHD, changed.cameraMatrixDepth, changed.distortionDepth, changed.rotation,
+                                       changed.translation));
+
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg->registerDepth(frames[i], registered);
+      regInit->registerDepth(frames[i], expected);
+      EXPECT_TRUE(equalImages(expected, registered)) << "method " << m << ", frame " << i;
+    }
+    EXPECT_FALSE(equalImages(original, expected)) << "method " << m;
+    delete reg;
+    delete regInit;
+  }
+}
+
+// With profiling enabled every stage of a registration is recorded once per frame, the statistics are ordered and reset clears
+// them. The CPU methods do not record anything.
+TEST(OpenCLDeviceTest, ProfilesStages)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(4, frames);
+
+  const DepthRegistration::Method methods[] = {DepthRegistration::OPENCL, DepthRegistration::OPENCL_ATOMIC, DepthRegistration::CPU};
+  const char *stages[][4] =
+  {
+    {"upload", "remapDepth", "checkDepth2", "download"},
+    {"upload", "remapDepth", "resolveDepth", "download"},
+    {NULL}
+  };
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    DepthRegistration *reg = DepthRegistration::New(methods[m]);
+    if(reg)
+    {
+      reg->setProfiling(true);
+    }
+    if(!reg || !reg->init(setup.cameraMatrixQHD, setup.sizeQHD, setup.cameraMatrixDepth, sizeTestDepth, setup.distortionDepth, setup.rotation,
+                  setup.translation))
+    {
+      std::cout << "skipping, no OpenCL device available." << std::endl;
+      delete reg;
+      continue;
+    }
+
+    cv::Mat registered;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      reg->registerDepth(frames[i], registered);
+    }
+
+    std::vector<DepthRegistration::ProfileStage> profile;
+    reg->getProfile(profile, true);
+    for(size_t i = 0; i < profile.size(); ++i)
+    {
+      const DepthRegistration::ProfileStage &stage = profile[i];
+      EXPECT_EQ(frames.size(), stage.count) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(0.0, stage.min) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.min, stage.median) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.median, stage.p90) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.p90, stage.p99) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.p99, stage.max) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.min, stage.mean) << "method " << m << ", stage " << stage.name;
+      EXPECT_LE(stage.mean, stage.max) << "method " << m << ", stage " << stage.name;
+    }
+
+    size_t expected = 0;
+    for(; expected < 4 && stages[m][expected]; ++expected)
+    {
+      bool found = false;
+      for(size_t i = 0; i < profile.size(); ++i)
+      {
+        found = found || profile[i].name == stages[m][expected];
+      }
+      EXPECT_TRUE(found) << "method " << m << ", stage " << stages[m][expected];
+    }
+    if(!expected)
+    {
+      EXPECT_TRUE(profile.empty()) << "method " << m;
+    }
+
+    reg->getProfile(profile);
+    EXPECT_TRUE(profile.empty()) << "method " << m;
+    delete reg;
+  }
+}
+
+// The registration on several devices has to give the same images as on a single one, synchronously, pipelined round robin over
+// the devices and with synchronous calls from another thread while frames are in flight. To cover the distribution it has to run
+// with at least two devices, e.g. with PoCL and POCL_DEVICES="pthread pthread".
+TEST(MultiOpenCLTest, MatchesSingleDevice)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(6, frames);
+
+  const DepthRegistration::Method methods[][2] =
+  {
+    {DepthRegistration::OPENCL, DepthRegistration::OPENCL_MULTI},
+    {DepthRegistration::OPENCL_ATOMIC, DepthRegistration::OPENCL_MULTI_ATOMIC}
+  };
+
+  for(size_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+  {
+    DepthRegistration *single = createTestRegistration(methods[m][0], setup, false);
+    DepthRegistration *multi = createTestRegistration(methods[m][1], setup, false);
+    if(!single || !multi)
+    {
+      std::cout << "skipping, no OpenCL device available." << std::endl;
+      delete single;
+      delete multi;
+      return;
+    }
+    const bool deterministic = isDeterministic(methods[m][0]);
+
+    std::vector<cv::Mat> expected(frames.size());
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      single->registerDepth(frames[i], expected[i]);
+    }
+
+    cv::Mat registered;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      multi->registerDepth(frames[i], registered);
+      EXPECT_TRUE(sameResult(expected[i], registered, deterministic)) << "method " << m << ", frame " << i;
+    }
+
+    // The pipelined results come back in order, the synchronous ones of the other thread are independent of them
+    std::vector<cv::Mat> pipelined, concurrent(frames.size());
+    std::thread other([&]()
+    {
+      for(size_t i = 0; i < frames.size(); ++i)
+      {
+        multi->registerDepth(frames[i], concurrent[i]);
+      }
+    });
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      if(multi->registerDepthAsync(frames[i], registered))
+      {
+        pipelined.push_back(registered.clone());
+      }
+    }
+    while(multi->finishDepthAsync(registered))
+    {
+      pipelined.push_back(registered.clone());
+    }
+    other.join();
+
+    ASSERT_EQ(frames.size(), pipelined.size()) << "method " << m;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      EXPECT_TRUE(sameResult(expected[i], pipelined[i], deterministic)) << "method " << m << ", pipelined frame " << i;
+      EXPECT_TRUE(sameResult(expected[i], concurrent[i], deterministic)) << "method " << m << ", concurrent frame " << i;
+    }
+    delete single;
+    delete multi;
+  }
+}
@@ -0,0 +1,122 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "registration_test_data.h"
+
+#ifdef DEPTH_REG_CPU
+#include "depth_registration_cpu.h"
+
+struct RemapKernelName
+{
+  DepthRegistrationCPU::RemapKernel kernel;
+  const char *name;
+};
+
+// Compares the SSE4.1 and AVX2 interpolation to the scalar one. The validity checks are exact in all kernels, only the
+// weighting is done in float instead of double, so valid pixels may differ by one millimeter due to rounding.
+class RemapTest : public testing::Test
+{
+protected:
+  cv::Mat depth;
+  std::vector<float> mapX, mapY;
+
+  void SetUp()
+  {
+    createTestFrame(0, depth);
+
+    // Random positions all over and just outside of the image, integer positions and ones at the borders
+    cv::RNG rng(42);
+    for(int i = 0; i < 100003; ++i)
+    {
+      mapX.push_back(rng.uniform(-2.0f, depth.cols + 1.0f));
+      mapY.push_back(rng.uniform(-2.0f, depth.rows + 1.0f));
+    }
+    for(int r = -1; r <= depth.rows; ++r)
+    {
+      for(int c = -1; c <= depth.cols; c += 7)
+      {
+        mapX.push_back((float)c);
+        mapY.push_back((float)r);
+      }
+    }
+    const float borders[] = {0.0f, 0.5f, depth.cols - 1.5f, depth.cols - 1.0f, depth.cols - 0.5f};
+    for(size_t i = 0; i < sizeof(borders) / sizeof(borders[0]); ++i)
+    {
+      mapX.push_back(borders[i]);
+      mapY.push_back(depth.rows * 0.5f);
+      mapX.push_back(depth.cols * 0.5f);
+      mapY.push_back(borders[i] * depth.rows / depth.cols);
+    }
+  }
+
+  void remap(const DepthRegistrationCPU::RemapRowFunc func, std::vector<uint16_t> &out) const
+  {
+    // Different widths per call, so that the remainders of the vectorized loops are used as well
+    out.assign(mapX.size(), 0);
+    for(size_t begin = 0, width = 1; begin < mapX.size(); begin += width, width = width % 37 + 1)
+    {
+      func(depth, &mapX[begin], &mapY[begin], &out[begin], std::min(width, mapX.size() - begin));
+    }
+  }
+};
+
+TEST_F(RemapTest, KernelsMatchScalar)
+{
+  const DepthRegistrationCPU::RemapRowFunc scalar = DepthRegistrationCPU::remapKernel(DepthRegistrationCPU::REMAP_SCALAR);
+  ASSERT_TRUE(scalar != NULL);
+
+  std::vector<uint16_t> expected;
+  remap(scalar, expected);
+  size_t valid = 0;
+  for(size_t i = 0; i < expected.size(); ++i)
+  {
+    valid += expected[i] ? 1 : 0;
+  }
+  ASSERT_GT(valid, expected.size() / 2);
+
+  const RemapKernelName kernels[] =
+  {
+    {DepthRegistrationCPU::REMAP_SSE41, "sse4.1"},
+    {DepthRegistrationCPU::REMAP_AVX2, "avx2"}
+  };
+  for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+  {
+    const DepthRegistrationCPU::RemapRowFunc func = DepthRegistrationCPU::remapKernel(kernels[k].kernel);
+    if(!func)
+    {
+      std::cout << "skipping " << kernels[k].name << ", not supported." << std::endl;
+      continue;
+    }
+
+    std::vector<uint16_t> out;
+    remap(func, out);
+    size_t mismatched = 0, outliers = 0;
+    for(size_t i = 0; i < expected.size(); ++i)
+    {
+      mismatched += (!out[i] != !expected[i]) ? 1 : 0;
+      outliers += std::abs(out[i] - expected[i]) > 1 ? 1 : 0;
+    }
+    EXPECT_EQ(0u, mismatched) << kernels[k].name;
+    EXPECT_EQ(0u, outliers) << kernels[k].name;
+  }
+}
+#endif
@@ -0,0 +1,76 @@
+/**
+ * Copyright 2014 University of Bremen, Institute for Artificial Intelligence
+ * Author: Thiemo Wiedemeyer <wiedemeyer@cs.uni-bremen.de>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+
+#include <gtest/gtest.h>
+
+#include "registration_test.h"
+
+// Registering a region of interest has to give the same pixels as registering the whole image and cropping it, also for regions
+// at the borders of the image, where points from outside of the field of view of the registered camera project into it
+TEST(ROITest, MatchesCroppedRegistration)
+{
+  TestSetup setup;
+  std::vector<cv::Mat> frames;
+  createTestSequence(2, frames);
+
+  const cv::Size &size = setup.sizeQHD;
+  const cv::Rect rois[] =
+  {
+    cv::Rect(0, 0, 64, 48),
+    cv::Rect(size.width - 64, size.height - 48, 64, 48),
+    cv::Rect(0, 200, 100, 80),
+    cv::Rect(size.width - 100, 0, 100, size.height),
+    cv::Rect(300, 0, 200, 30),
+    cv::Rect(250, size.height - 30, 300, 30),
+    cv::Rect(400, 250, 120, 90),
+    cv::Rect(size.width - 1, size.height - 1, 1, 1),
+    cv::Rect(0, 0, size.width, size.height)
+  };
+  const size_t roiCount = sizeof(rois) / sizeof(rois[0]);
+
+  for(size_t m = 0; m < testMethodCount; ++m)
+  {
+    const TestMethod &method = testMethods[m];
+    DepthRegistration *full = createTestRegistration(method.method, setup, false);
+    DepthRegistration *reg = createTestRegistration(method.method, setup, false);
+    if(!full || !reg)
+    {
+      std::cout << "skipping " << method.name << ", not available." << std::endl;
+      delete full;
+      delete reg;
+      continue;
+    }
+
+    cv::Mat expected, registered;
+    for(size_t i = 0; i < frames.size(); ++i)
+    {
+      full->registerDepth(frames[i], expected);
+      for(size_t r = 0; r < roiCount; ++r)
+      {
+        const cv::Rect &roi = rois[r];
+        reg->registerDepth(frames[i], roi, registered);
+        ASSERT_EQ(roi.size(), registered.size()) << method.name;
+        EXPECT_TRUE(sameResult(expected(roi), registered, isDeterministic(method.method)))
+            << method.name << ", frame " << i << ", region " << roi.x << "," << roi.y << " " << roi.width << "x" << roi.height;
+      }
+    }
+    delete full;
+    delete reg;
+  }
+}